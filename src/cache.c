@@ -0,0 +1,594 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "mapping.h"
+#include "memory.h"
+#include "vm.h"
+
+// Bump whenever this format or the meaning of any opcode changes, so old cache files get thrown away
+#define CACHE_VERSION 2
+#define CACHE_MAGIC "loxc"
+#define CACHE_BYTE_ORDER 0x01020304 // Images are in the byte order of the machine that wrote them, and only load on one that matches
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+#define NO_STRING UINT32_MAX
+
+const char* cacheDirectory = NULL;
+
+typedef enum
+{
+	CONSTANT_NIL,
+	CONSTANT_BOOL,
+	CONSTANT_NUMBER,
+	CONSTANT_STRING, // Heap string, as used for names
+	CONSTANT_SHORT_STRING,
+	CONSTANT_FUNCTION
+} ConstantTag;
+
+/*
+	An image is a header, a table of every function (the script is the first), then each function's code, lines and constants, then the strings
+	There are no pointers in it, only offsets from the start of the image (strings: from stringsOffset), so it works wherever it's mapped
+	Code and lines are used in place, and constants turned into values, when the function is first called
+	All the fields are fixed-size and in order of alignment, so the structs have the same layout on every compiler
+*/
+typedef struct
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t opcodeCount;
+	uint32_t flags; // 1 = compiled with -O
+	uint32_t functionCount;
+	uint64_t sourceLength;
+	uint64_t sourceHash;
+	uint64_t imageLength;
+	uint64_t imageHash; // Of everything after the header
+	uint32_t stringsOffset;
+	uint32_t padding;
+} ImageHeader;
+
+typedef struct
+{
+	uint32_t arity;
+	uint32_t upvalueCount;
+	uint32_t localCount;
+	uint32_t accessor;
+	uint32_t accessorField;
+	uint32_t name; // String offset or NO_STRING
+	uint32_t codeOffset;
+	uint32_t codeCount;
+	uint32_t linesOffset; // LineStarts
+	uint32_t lineCount;
+	uint32_t constantsOffset; // ImageConstants
+	uint32_t constantCount;
+} ImageFunction;
+
+typedef struct
+{
+	uint32_t tag;
+	uint32_t index; // String offset for CONSTANT_STRING, function index for CONSTANT_FUNCTION
+	uint64_t bits; // The number's bits, the bool, or the short string's payload
+} ImageConstant;
+
+// Each string is its length followed by its chars, starting on a 4-byte boundary
+typedef struct
+{
+	uint32_t length;
+	char chars[];
+} ImageString;
+
+typedef struct
+{
+	uint8_t* bytes;
+	int count;
+	int capacity;
+	bool failed; // Found a constant it can't write, or got too big for 32-bit offsets
+} Writer;
+
+typedef struct MappedImage
+{
+	struct MappedImage* next;
+	MappedFile file;
+} MappedImage;
+
+static MappedImage* images = NULL;
+
+// The code of every function from an image until its first call
+static uint8_t loadStub[] = { OP_LOAD_FUNCTION };
+
+static uint64_t hashBytes(const void* bytes, size_t length)
+{
+	// FNV-1a a word at a time. Only has to catch changed sources and damaged files, not resist anyone
+	const uint8_t* byte = (const uint8_t*)bytes;
+	uint64_t hash = FNV_OFFSET;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, byte + i, 8);
+		hash = (hash ^ word) * FNV_PRIME;
+		hash ^= hash >> 32; // The multiply only carries upwards
+	}
+	for (; i < length; i++)
+	{
+		hash = (hash ^ byte[i]) * FNV_PRIME;
+	}
+	return hash;
+}
+
+static uint32_t currentFlags()
+{
+	return optimizeIR ? 1 : 0;
+}
+
+static void cachePath(char* path, size_t size, uint64_t sourceHash)
+{
+	// -O compiles the same source differently, so it gets its own file
+	snprintf(path, size, "%s/%016llx%s.loxc", cacheDirectory, (unsigned long long)sourceHash, optimizeIR ? "-O" : "");
+}
+
+static void writeBytes(Writer* writer, const void* bytes, int length)
+{
+	if (length == 0)
+		return;
+	if (writer->count > INT32_MAX - length)
+	{
+		writer->failed = true;
+		return;
+	}
+
+	if (writer->capacity < writer->count + length)
+	{
+		int oldCapacity = writer->capacity;
+		while (writer->capacity < writer->count + length)
+			writer->capacity = GROW_CAPACITY(writer->capacity);
+		writer->bytes = GROW_ARRAY(uint8_t, writer->bytes, oldCapacity, writer->capacity);
+	}
+
+	memcpy(writer->bytes + writer->count, bytes, length);
+	writer->count += length;
+}
+
+static void alignWriter(Writer* writer, int alignment)
+{
+	static const uint8_t zeroes[8] = { 0 };
+	if (writer->count % alignment != 0)
+		writeBytes(writer, zeroes, alignment - writer->count % alignment);
+}
+
+// Strings are written once however many functions use them. The table maps each to its offset
+static uint32_t writeString(Writer* strings, Table* written, ObjString* string)
+{
+	Value offset;
+	if (tableGet(written, string, &offset))
+		return (uint32_t)AS_NUMBER(offset);
+
+	alignWriter(strings, 4);
+	uint32_t start = (uint32_t)strings->count;
+	uint32_t length = (uint32_t)string->length;
+	writeBytes(strings, &length, sizeof(length));
+	writeBytes(strings, string->chars, string->length);
+	tableSet(written, string, NUMBER_VAL(start));
+	return start;
+}
+
+static void addFunction(ObjFunction*** functions, int* count, int* capacity, ObjFunction* function)
+{
+	if (*capacity < *count + 1)
+	{
+		int oldCapacity = *capacity;
+		*capacity = GROW_CAPACITY(oldCapacity);
+		*functions = GROW_ARRAY(ObjFunction*, *functions, oldCapacity, *capacity);
+	}
+	(*functions)[(*count)++] = function;
+}
+
+static ImageConstant imageConstant(Writer* strings, Table* written, Value value, uint32_t* nextFunction, bool* failed)
+{
+	ImageConstant constant = { 0, 0, 0 };
+	if (IS_NIL(value))
+	{
+		constant.tag = CONSTANT_NIL;
+	}
+	else if (IS_BOOL(value))
+	{
+		constant.tag = CONSTANT_BOOL;
+		constant.bits = AS_BOOL(value) ? 1 : 0;
+	}
+	else if (IS_NUMBER(value))
+	{
+		double number = AS_NUMBER(value);
+		constant.tag = CONSTANT_NUMBER;
+		memcpy(&constant.bits, &number, sizeof(number));
+	}
+	else if (IS_SHORT_STRING(value))
+	{
+		constant.tag = CONSTANT_SHORT_STRING;
+		constant.bits = SHORT_STRING_PAYLOAD(value);
+	}
+	else if (IS_STRING(value))
+	{
+		constant.tag = CONSTANT_STRING;
+		constant.index = writeString(strings, written, AS_STRING(value));
+	}
+	else if (IS_FUNCTION(value))
+	{
+		constant.tag = CONSTANT_FUNCTION;
+		constant.index = (*nextFunction)++;
+	}
+	else
+	{
+		*failed = true; // The compiler doesn't make any other constants
+	}
+	return constant;
+}
+
+// Null if the script can't be written as an image. The caller frees it
+static uint8_t* writeImage(ObjFunction* script, size_t sourceLength, uint64_t sourceHash, int* length)
+{
+	// Breadth first, so each function's nested functions get the next free indexes in the order its constants name them
+	ObjFunction** functions = NULL;
+	int functionCount = 0;
+	int functionCapacity = 0;
+	addFunction(&functions, &functionCount, &functionCapacity, script);
+	for (int i = 0; i < functionCount; i++)
+	{
+		// A lazy function is compiled now, since the image is all a later run gets. The script is on the stack, so this is safe from the GC
+		if (functions[i]->lazy != NULL && !compileLazyFunction(functions[i]))
+		{
+			FREE_ARRAY(ObjFunction*, functions, functionCapacity);
+			return NULL;
+		}
+
+		ValueArray* constants = &functions[i]->chunk.constants;
+		for (int j = 0; j < constants->count; j++)
+		{
+			if (IS_FUNCTION(constants->values[j]))
+				addFunction(&functions, &functionCount, &functionCapacity, AS_FUNCTION(constants->values[j]));
+		}
+	}
+
+	ImageFunction* records = ALLOCATE(ImageFunction, functionCount);
+	Writer image = { NULL, 0, 0, false };
+	Writer strings = { NULL, 0, 0, false };
+	Table written;
+	initTable(&written);
+
+	// The header and function table are filled in once everything after them is written
+	ImageHeader header;
+	memset(&header, 0, sizeof(header));
+	writeBytes(&image, &header, sizeof(header));
+	for (int i = 0; i < functionCount; i++)
+		writeBytes(&image, &records[i], sizeof(ImageFunction));
+
+	uint32_t nextFunction = 1;
+	bool failed = false;
+	for (int i = 0; i < functionCount; i++)
+	{
+		ObjFunction* function = functions[i];
+		Chunk* chunk = &function->chunk;
+		ImageFunction* record = &records[i];
+		record->arity = function->arity;
+		record->upvalueCount = function->upvalueCount;
+		record->localCount = function->localCount;
+		record->accessor = function->accessor;
+		record->accessorField = function->accessorField;
+		record->name = function->name == NULL ? NO_STRING : writeString(&strings, &written, function->name);
+
+		record->codeOffset = image.count;
+		record->codeCount = chunk->count;
+		writeBytes(&image, chunk->code, chunk->count);
+
+		alignWriter(&image, 4);
+		record->linesOffset = image.count;
+		record->lineCount = chunk->lines.count;
+		writeBytes(&image, chunk->lines.starts, sizeof(LineStart) * chunk->lines.count);
+
+		alignWriter(&image, 8);
+		record->constantsOffset = image.count;
+		record->constantCount = chunk->constants.count;
+		for (int j = 0; j < chunk->constants.count; j++)
+		{
+			ImageConstant constant = imageConstant(&strings, &written, chunk->constants.values[j], &nextFunction, &failed);
+			writeBytes(&image, &constant, sizeof(constant));
+		}
+	}
+
+	alignWriter(&image, 8);
+	header.stringsOffset = image.count;
+	writeBytes(&image, strings.bytes, strings.count);
+
+	if (!image.failed && !strings.failed && !failed)
+	{
+		memcpy(image.bytes + sizeof(ImageHeader), records, sizeof(ImageFunction) * functionCount);
+
+		memcpy(header.magic, CACHE_MAGIC, 4);
+		header.version = CACHE_VERSION;
+		header.byteOrder = CACHE_BYTE_ORDER;
+		header.opcodeCount = OP_WIDE + 1;
+		header.flags = currentFlags();
+		header.functionCount = functionCount;
+		header.sourceLength = sourceLength;
+		header.sourceHash = sourceHash;
+		header.imageLength = image.count;
+		header.imageHash = hashBytes(image.bytes + sizeof(ImageHeader), image.count - sizeof(ImageHeader));
+		memcpy(image.bytes, &header, sizeof(header));
+	}
+	else
+	{
+		failed = true;
+	}
+
+	freeTable(&written);
+	FREE_ARRAY(uint8_t, strings.bytes, strings.capacity);
+	FREE_ARRAY(ImageFunction, records, functionCount);
+	FREE_ARRAY(ObjFunction*, functions, functionCapacity);
+
+	if (failed)
+	{
+		FREE_ARRAY(uint8_t, image.bytes, image.capacity);
+		return NULL;
+	}
+
+	// Hand back an exact-sized block so the caller can free it with the length
+	uint8_t* bytes = GROW_ARRAY(uint8_t, image.bytes, image.capacity, image.count);
+	*length = image.count;
+	return bytes;
+}
+
+static bool inImage(const ImageHeader* header, uint64_t offset, uint64_t size, int alignment)
+{
+	return offset % alignment == 0 && offset <= header->imageLength && size <= header->imageLength - offset;
+}
+
+static bool validString(const uint8_t* image, const ImageHeader* header, uint32_t offset)
+{
+	uint64_t start = (uint64_t)header->stringsOffset + offset;
+	if (!inImage(header, start, sizeof(ImageString), 4))
+		return false;
+
+	const ImageString* string = (const ImageString*)(image + start);
+	return string->length <= INT32_MAX && inImage(header, start + sizeof(ImageString), string->length, 1);
+}
+
+// Everything is checked up front, so loading constants later can't fail
+static bool validFunction(const uint8_t* image, const ImageHeader* header, const ImageFunction* record)
+{
+	if (record->arity > UINT8_MAX || record->upvalueCount > UINT16_COUNT || record->localCount > UINT16_COUNT ||
+		record->accessor > ACCESSOR_SETTER || record->accessorField > UINT8_MAX)
+		return false;
+	if (record->name != NO_STRING && !validString(image, header, record->name))
+		return false;
+
+	if (record->codeCount == 0 || record->codeCount > INT32_MAX || !inImage(header, record->codeOffset, record->codeCount, 1) ||
+		!inImage(header, record->linesOffset, (uint64_t)record->lineCount * sizeof(LineStart), 4) ||
+		!inImage(header, record->constantsOffset, (uint64_t)record->constantCount * sizeof(ImageConstant), 8) ||
+		record->constantCount > WIDE_MAX + 1)
+		return false;
+
+	const LineStart* lines = (const LineStart*)(image + record->linesOffset);
+	for (uint32_t i = 0; i < record->lineCount; i++)
+	{
+		if (lines[i].offset < 0 || (uint32_t)lines[i].offset >= record->codeCount || (i > 0 && lines[i].offset <= lines[i - 1].offset))
+			return false;
+	}
+
+	const ImageConstant* constants = (const ImageConstant*)(image + record->constantsOffset);
+	for (uint32_t i = 0; i < record->constantCount; i++)
+	{
+		switch (constants[i].tag)
+		{
+		case CONSTANT_NIL:
+		case CONSTANT_BOOL:
+		case CONSTANT_NUMBER:
+			break;
+		case CONSTANT_SHORT_STRING:
+			if ((constants[i].bits >> 40) > SHORT_STRING_MAX)
+				return false; // Length in bits 40-42, nothing above
+			break;
+		case CONSTANT_STRING:
+			if (!validString(image, header, constants[i].index))
+				return false;
+			break;
+		case CONSTANT_FUNCTION:
+			if (constants[i].index == 0 || constants[i].index >= header->functionCount)
+				return false; // Nothing nests the script
+			break;
+		default:
+			return false;
+		}
+	}
+
+	// Accessors are run straight from the field's name
+	if (record->accessor != ACCESSOR_NONE &&
+		(record->accessorField >= record->constantCount || constants[record->accessorField].tag != CONSTANT_STRING))
+		return false;
+
+	return true;
+}
+
+static bool validImage(const uint8_t* image, size_t length, size_t sourceLength, uint64_t sourceHash)
+{
+	if (length < sizeof(ImageHeader))
+		return false;
+
+	// Anything that doesn't match is treated like a missing file, and gets replaced after compiling
+	const ImageHeader* header = (const ImageHeader*)image;
+	if (memcmp(header->magic, CACHE_MAGIC, 4) != 0 || header->version != CACHE_VERSION || header->byteOrder != CACHE_BYTE_ORDER ||
+		header->opcodeCount != OP_WIDE + 1 || header->flags != currentFlags() ||
+		header->sourceLength != sourceLength || header->sourceHash != sourceHash ||
+		header->imageLength != length || header->stringsOffset > length || header->functionCount == 0 ||
+		!inImage(header, sizeof(ImageHeader), (uint64_t)header->functionCount * sizeof(ImageFunction), 8))
+		return false;
+
+	if (header->imageHash != hashBytes(image + sizeof(ImageHeader), length - sizeof(ImageHeader)))
+		return false;
+
+	const ImageFunction* records = (const ImageFunction*)(image + sizeof(ImageHeader));
+	for (uint32_t i = 0; i < header->functionCount; i++)
+	{
+		if (!validFunction(image, header, &records[i]))
+			return false;
+	}
+	return true;
+}
+
+static ObjString* imageString(const uint8_t* image, uint32_t offset)
+{
+	const ImageHeader* header = (const ImageHeader*)image;
+	const ImageString* string = (const ImageString*)(image + header->stringsOffset + offset);
+	return copyString(string->chars, (int)string->length);
+}
+
+// Everything but the code and constants. Those wait for loadImageFunction()
+static ObjFunction* imageFunction(const uint8_t* image, uint32_t index)
+{
+	const ImageFunction* record = (const ImageFunction*)(image + sizeof(ImageHeader)) + index;
+	ObjFunction* function = newFunction();
+	function->arity = (int)record->arity;
+	function->upvalueCount = (int)record->upvalueCount;
+	function->localCount = (int)record->localCount;
+	function->accessor = (AccessorKind)record->accessor;
+	function->accessorField = (uint8_t)record->accessorField;
+	function->image = image;
+	function->imageFunction = index;
+
+	Chunk* chunk = &function->chunk;
+	chunk->storage = CHUNK_MAPPED;
+	chunk->code = loadStub;
+	chunk->count = chunk->capacity = 1;
+
+	push(OBJ_VAL(function));
+	if (record->name != NO_STRING)
+		function->name = imageString(image, record->name);
+	if (function->accessor != ACCESSOR_NONE)
+		loadImageFunction(function); // Calls to these read the field's name without running any code
+	pop();
+	return function;
+}
+
+void loadImageFunction(ObjFunction* function)
+{
+	const uint8_t* image = function->image;
+	const ImageFunction* record = (const ImageFunction*)(image + sizeof(ImageHeader)) + function->imageFunction;
+	const ImageConstant* constants = (const ImageConstant*)(image + record->constantsOffset);
+
+	Chunk* chunk = &function->chunk;
+	chunk->code = (uint8_t*)(image + record->codeOffset); // Never written, the mapping is read-only
+	chunk->count = chunk->capacity = (int)record->codeCount;
+#ifndef STRIP_LINES
+	chunk->lines.starts = (LineStart*)(image + record->linesOffset);
+	chunk->lines.count = chunk->lines.capacity = (int)record->lineCount;
+#endif
+
+	// Each value goes in as soon as it's made, so the ones before it are safe from the GC
+	ValueArray* values = &chunk->constants;
+	values->values = ALLOCATE(Value, record->constantCount);
+	values->capacity = (int)record->constantCount;
+	for (uint32_t i = 0; i < record->constantCount; i++)
+	{
+		const ImageConstant* constant = &constants[i];
+		Value value = NIL_VAL;
+		switch (constant->tag)
+		{
+		case CONSTANT_NIL: break;
+		case CONSTANT_BOOL: value = BOOL_VAL(constant->bits != 0); break;
+		case CONSTANT_NUMBER:
+		{
+			double number;
+			memcpy(&number, &constant->bits, sizeof(number));
+			value = NUMBER_VAL(number);
+			break;
+		}
+		case CONSTANT_SHORT_STRING: value = SHORT_STRING_PAYLOAD_VAL(constant->bits); break;
+		case CONSTANT_STRING: value = OBJ_VAL(imageString(image, constant->index)); break;
+		case CONSTANT_FUNCTION: value = OBJ_VAL(imageFunction(image, constant->index)); break;
+		}
+		values->values[values->count++] = value;
+	}
+
+	function->image = NULL;
+}
+
+ObjFunction* loadCachedScript(const char* source, size_t sourceLength)
+{
+	if (cacheDirectory == NULL)
+		return NULL;
+
+	uint64_t sourceHash = hashBytes(source, sourceLength);
+	char path[4096];
+	cachePath(path, sizeof(path), sourceHash);
+
+	MappedFile file;
+	if (!mapFile(path, &file))
+		return NULL; // Not cached yet
+
+	const uint8_t* bytes = (const uint8_t*)file.bytes;
+	if (!validImage(bytes, file.length, sourceLength, sourceHash))
+	{
+		unmapFile(&file);
+		return NULL;
+	}
+
+	// Stays mapped until the VM is freed, since functions from it can end up anywhere
+	MappedImage* image = ALLOCATE(MappedImage, 1);
+	image->file = file;
+	image->next = images;
+	images = image;
+
+	return imageFunction(bytes, 0);
+}
+
+void saveCachedScript(const char* source, size_t sourceLength, ObjFunction* function)
+{
+	if (cacheDirectory == NULL)
+		return;
+
+	uint64_t sourceHash = hashBytes(source, sourceLength);
+	int length;
+	uint8_t* bytes = writeImage(function, sourceLength, sourceHash, &length);
+	if (bytes == NULL)
+		return;
+
+	// Written next to it and renamed over it, so a process that has the old file mapped keeps its pages
+	char path[4096];
+	char temporary[4096 + 4];
+	cachePath(path, sizeof(path), sourceHash);
+	snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+	FILE* file = fopen(temporary, "wb");
+	if (file != NULL)
+	{
+		bool written = fwrite(bytes, 1, length, file) == (size_t)length;
+		if (fclose(file) == 0 && written)
+		{
+#ifdef _WIN32
+			remove(path); // rename() won't replace a file here. Fails (and so does the rename) if the old one is still mapped
+#endif
+			if (rename(temporary, path) != 0)
+				remove(temporary);
+		}
+		else
+		{
+			remove(temporary);
+		}
+	}
+
+	FREE_ARRAY(uint8_t, bytes, length);
+}
+
+void freeCachedImages()
+{
+	while (images != NULL)
+	{
+		MappedImage* next = images->next;
+		unmapFile(&images->file);
+		FREE(MappedImage, images);
+		images = next;
+	}
+}
@@ -0,0 +1,21 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "object.h"
+
+// Compiled scripts are saved in this directory, named by a hash of their source, so running the same source again skips the compiler
+// The files are images that get mapped read-only and run in place, so processes running the same script share their pages
+// Set by -c. NULL leaves the cache off
+extern const char* cacheDirectory;
+
+// The script's function from an earlier run of exactly this source, or NULL if there's no cache file or it's stale or corrupt
+ObjFunction* loadCachedScript(const char* source, size_t sourceLength);
+// function has to be reachable by the GC
+void saveCachedScript(const char* source, size_t sourceLength, ObjFunction* function);
+
+// Swaps the OP_LOAD_FUNCTION stub of a function from an image for its real code and constants. function has to be reachable by the GC
+void loadImageFunction(ObjFunction* function);
+// Unmaps every image. Only once nothing can run their functions anymore
+void freeCachedImages();
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include "chunk.h"
 #include "memory.h"
 #include "vm.h"
@@ -9,15 +10,33 @@ void initChunk(Chunk* chunk)
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = NULL;
-	chunk->lines = NULL;
+	initLineTable(&chunk->lines);
 	initValueArray(&chunk->constants); // constants isn't a pointer, so we need & to get the address
+	chunk->storage = CHUNK_GROWING;
+}
+
+static size_t frozenSize(Chunk* chunk)
+{
+	return sizeof(Value) * chunk->constants.count + sizeof(LineStart) * chunk->lines.count + chunk->count;
 }
 
 void freeChunk(Chunk* chunk)
 {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
-	freeValueArray(&chunk->constants);
+	switch (chunk->storage)
+	{
+	case CHUNK_GROWING:
+		FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+		freeLineTable(&chunk->lines);
+		freeValueArray(&chunk->constants);
+		break;
+	case CHUNK_FROZEN:
+		reallocate(chunk->constants.values, frozenSize(chunk), 0);
+		break;
+	case CHUNK_MAPPED:
+		freeValueArray(&chunk->constants);
+		break;
+	}
+
 	initChunk(chunk); // Zero-out the chunk to ensure the state is defined
 }
 
@@ -29,11 +48,10 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line)
 		int oldCapacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(oldCapacity);
 		chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-		chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
 	}
 
 	chunk->code[chunk->count] = byte;
-	chunk->lines[chunk->count] = line;
+	writeLine(&chunk->lines, chunk->count, line);
 	chunk->count++;
 }
 
@@ -43,4 +61,85 @@ int addConstant(Chunk* chunk, Value value)
 	writeValueArray(&chunk->constants, value);
 	pop();
 	return chunk->constants.count - 1; // Use '.' since constants is not a pointer
+}
+
+void freezeChunk(Chunk* chunk)
+{
+	int constantCount = chunk->constants.count;
+	int lineCount = chunk->lines.count;
+	int codeCount = chunk->count;
+
+	// Ordered by alignment so nothing needs padding. Code goes last, right after the constants and lines it's read with
+	uint8_t* block = ALLOCATE(uint8_t, frozenSize(chunk));
+	Value* constants = (Value*)block;
+	LineStart* lines = (LineStart*)(constants + constantCount);
+	uint8_t* code = (uint8_t*)(lines + lineCount);
+	if (constantCount > 0) // Nothing was ever allocated for empty arrays
+		memcpy(constants, chunk->constants.values, sizeof(Value) * constantCount);
+	if (lineCount > 0)
+		memcpy(lines, chunk->lines.starts, sizeof(LineStart) * lineCount);
+	memcpy(code, chunk->code, codeCount);
+
+	// Frees the old arrays and zeroes the counts
+	freeChunk(chunk);
+
+	chunk->code = code;
+	chunk->count = chunk->capacity = codeCount;
+	chunk->lines.starts = lines;
+	chunk->lines.count = chunk->lines.capacity = lineCount;
+	chunk->constants.values = constants;
+	chunk->constants.count = chunk->constants.capacity = constantCount;
+	chunk->storage = CHUNK_FROZEN;
+}
+
+void initLineTable(LineTable* table)
+{
+	table->count = 0;
+	table->capacity = 0;
+	table->starts = NULL;
+}
+
+void freeLineTable(LineTable* table)
+{
+	FREE_ARRAY(LineStart, table->starts, table->capacity);
+	initLineTable(table);
+}
+
+void writeLine(LineTable* table, int offset, int line)
+{
+#ifndef STRIP_LINES
+	if (table->count > 0 && table->starts[table->count - 1].line == line)
+		return; // Still the same line
+
+	if (table->capacity < table->count + 1)
+	{
+		int oldCapacity = table->capacity;
+		table->capacity = GROW_CAPACITY(oldCapacity);
+		table->starts = GROW_ARRAY(LineStart, table->starts, oldCapacity, table->capacity);
+	}
+
+	table->starts[table->count].offset = offset;
+	table->starts[table->count].line = line;
+	table->count++;
+#endif
+}
+
+int getLine(LineTable* table, int offset)
+{
+	if (table->count == 0)
+		return 0;
+
+	// Binary search for the last line that starts at or before offset
+	int low = 0;
+	int high = table->count - 1;
+	while (low < high)
+	{
+		int middle = (low + high + 1) / 2;
+		if (table->starts[middle].offset <= offset)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+
+	return table->starts[low].line;
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
 typedef	enum
 {
 	OP_CONSTANT,
+	OP_CONSTANT_LONG, // Three-byte constant index
 	OP_NIL,
 	OP_TRUE,
 	OP_FALSE,
@@ -26,38 +27,89 @@ typedef	enum
 	OP_GREATER,
 	OP_LESS,
 	OP_ADD,
+	OP_CONCAT_N,
 	OP_SUBTRACT,
 	OP_MULTIPLY,
 	OP_DIVIDE,
 	OP_NOT,
 	OP_NEGATE,
+	OP_GREATER_NN, // Only produced by -O, for operands already known to be numbers
+	OP_LESS_NN,
+	OP_ADD_NN,
+	OP_SUBTRACT_NN,
+	OP_MULTIPLY_NN,
+	OP_DIVIDE_NN,
+	OP_ADD_LOCAL, // local = local + n; as a statement, for a small whole n
+	OP_INC_LOCAL, // Only produced by -O. OP_ADD_LOCAL for a local known to be a number
 	OP_PRINT,
 	OP_JUMP,
 	OP_JUMP_IF_FALSE,
+	OP_JUMP_IF_TRUE, // Only produced by the optimizer
 	OP_LOOP,
+	OP_JUMP_IF_NOT_LESS, // A loop condition comparing two locals, fused with its exit jump
+	OP_JUMP_IF_NOT_GREATER,
+	OP_JUMP_IF_NOT_LESS_CONST, // A local compared with a constant
+	OP_JUMP_IF_NOT_GREATER_CONST,
 	OP_CALL,
 	OP_INVOKE,
 	OP_SUPER_INVOKE,
+	OP_INLINE_GUARD, // Only produced by -O. Runs an inlined body, or calls the callee and jumps past it
+	OP_INLINE_RETURN,
 	OP_CLOSURE,
 	OP_CLOSE_UPVALUE,
 	OP_RETURN,
 	OP_CLASS,
 	OP_INHERIT,
-	OP_METHOD
+	OP_METHOD,
+	OP_LOAD_FUNCTION, // Never compiled. All the code of a function whose real code hasn't been loaded yet, see cache.c
+	OP_WIDE // Prefix. The next instruction's index or jump offset is three bytes instead of one or two
 } OpCode;
 
+#define WIDE_MAX 0xffffff
+
+// Bytecode from the same line shares one entry, so the table is about one entry per source line instead of an int per byte
+typedef struct
+{
+	int offset; // First byte on this line
+	int line;
+} LineStart;
+
+typedef struct
+{
+	int count;
+	int capacity;
+	LineStart* starts;
+} LineTable;
+
+typedef enum
+{
+	CHUNK_GROWING, // Still being written by the compiler
+	CHUNK_FROZEN, // Everything lives in one block owned by the constants, see freezeChunk()
+	CHUNK_MAPPED // Code and lines point into a mapped image (see cache.c) or are a lazy function's stub. Only the constants belong to the chunk
+} ChunkStorage;
+
 typedef	struct
 {
 	int count;
 	int capacity;
 	uint8_t* code;
-	int* lines;
+	LineTable lines;
 	ValueArray constants;
+	ChunkStorage storage;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+// Packs constants, lines and code into one exact-sized block once the compiler is done with the chunk. Can't be written to after
+void freezeChunk(Chunk* chunk);
+
+void initLineTable(LineTable* table);
+void freeLineTable(LineTable* table);
+// Offsets have to come in order. Does nothing with STRIP_LINES
+void writeLine(LineTable* table, int offset, int line);
+// Line of the byte at offset, or 0 if lines were stripped
+int getLine(LineTable* table, int offset);
 
 #endif
\ No newline at end of file
@@ -6,11 +6,15 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+//#define COMPRESSED_POINTERS // 32-bit object references into one reserved heap region. 64-bit builds only
+//#define STRIP_LINES // No line numbers in bytecode, to save memory. Runtime errors only name the functions
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
+//#define DEBUG_HASH_TEST // Benchmark the string hash and check its bucket spread instead of running anything. Don't combine with DEBUG_STRESS_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif
\ No newline at end of file
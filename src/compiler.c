@@ -7,6 +7,8 @@
 #include "scanner.h"
 #include "chunk.h"
 #include "memory.h"
+#include "ir.h"
+#include "optimizer.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -53,8 +55,9 @@ typedef struct
 
 typedef struct
 {
-	uint8_t index;
+	int index;
 	bool isLocal;
+	Token name; // So a body compiled on its first call can find what was captured for it
 } Upvalue;
 
 typedef	enum
@@ -65,16 +68,41 @@ typedef	enum
 	TYPE_SCRIPT
 } FunctionType;
 
+// A constant load the compiler just emitted, kept around so an operator applied to it can be folded at compile time
+typedef struct
+{
+	int start; // Offset of the load instruction
+	int end;
+	int constantCount; // Size of the constant pool before the load was emitted
+	Value value;
+} FoldableConstant;
+
 struct Compiler
 {
 	struct Compiler* enclosing; // Can't reference the typedef yet
 	ObjFunction* function;
 	FunctionType type;
 
-	Local locals[UINT8_COUNT];
+	// Both grow as needed, up to UINT16_COUNT
+	Local* locals;
 	int	localCount;
-	Upvalue	upvalues[UINT8_COUNT];
+	int localCapacity;
+	Upvalue* upvalues;
+	int upvalueCapacity;
 	int	scopeDepth; // Number of blocks that surround the code currently being compiled
+
+	// Open-addressed set of constant pool indexes, hashed by the constant at each, so a number or string only goes in the pool once
+	int* constantSet;
+	int constantSetCount;
+	int constantSetCapacity;
+
+	bool wideJumps; // Forward jumps get three-byte offsets
+	bool jumpTooFar; // A forward jump didn't fit in two bytes, so the function has to be compiled again with wideJumps
+
+	FoldableConstant lastConstant;
+	int lastJumpTarget; // Furthest offset a forward jump lands on. Code before and after it can't be folded together
+	int operandStart; // Where the left operand of the infix operator being compiled starts
+	bool unreachable; // Control can't get past the code emitted so far (after a return or an endless loop)
 };
 
 typedef struct Compiler Compiler;
@@ -85,10 +113,43 @@ typedef struct ClassCompiler
 	bool hasSuperclass;
 } ClassCompiler;
 
+// A function whose body was only checked when it was declared. Enough to compile it on its first call
+struct LazyFunction
+{
+	FunctionType type;
+	Scanner scanner; // Just past the '(' before the parameters
+	Token start; // The '(' itself
+	bool inClass;
+	bool hasSuperclass;
+	Upvalue* upvalues; // function->upvalueCount of them, in the order OP_CLOSURE was given them
+};
+
+// A function that compiled fine inside one that may still be compiled again with wide jumps. Its own code doesn't change
+// when that happens, so the retry picks it up here instead of compiling it (and everything nested in it) again
+typedef struct
+{
+	const char* start; // The '(' before its parameters
+	ObjFunction* function;
+	Upvalue* upvalues; // function->upvalueCount of them
+	Parser parserEnd;
+	Scanner scannerEnd;
+} FinishedFunction;
+
+// Sorted by start, since functions finish in source order and a finished function replaces the ones nested in it
+// Only holds the direct children of the functions still being compiled
+static FinishedFunction* finished = NULL;
+static int finishedCount = 0;
+static int finishedCapacity = 0;
+
 Parser parser;
 Compiler* current = NULL;
+bool optimizeIR = false;
+bool lazyFunctions = false;
 ClassCompiler* currentClass = NULL;
 
+// Code of a function until its body is compiled
+static uint8_t lazyStub[] = { OP_LOAD_FUNCTION };
+
 static Chunk* currentChunk()
 {
 	return &current->function->chunk;
@@ -180,20 +241,55 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
 	emitByte(byte2);
 }
 
+// Three-byte operand for OP_CONSTANT_LONG and OP_WIDE instructions
+static void emitLong(int value)
+{
+	emitByte((value >> 16) & 0xff);
+	emitByte((value >> 8) & 0xff);
+	emitByte(value & 0xff);
+}
+
+// Instructions with an index take it in one byte, or in three after an OP_WIDE
+static void emitIndexed(uint8_t instruction, int index)
+{
+	if (index <= UINT8_MAX)
+	{
+		emitBytes(instruction, (uint8_t)index);
+		return;
+	}
+
+	emitBytes(OP_WIDE, instruction);
+	emitLong(index);
+}
+
 static void emitLoop(int loopStart)
 {
-	emitByte(OP_LOOP);
+	int offset = currentChunk()->count - loopStart + 3; // Make sure to jump over this instruction and its operands
+	if (offset <= UINT16_MAX)
+	{
+		emitByte(OP_LOOP);
+		emitByte((offset >> 8) & 0xff);
+		emitByte(offset & 0xff);
+		return;
+	}
 
-	int offset = currentChunk()->count - loopStart + 2; // Make sure to jump over this instruction's operands
-	if (offset > UINT16_MAX)
+	offset += 2; // The OP_WIDE and the extra operand byte
+	if (offset > WIDE_MAX)
 		error("Loop body too large");
 
-	emitByte((offset >> 8) & 0xff);
-	emitByte(offset & 0xff);
+	emitBytes(OP_WIDE, OP_LOOP);
+	emitLong(offset);
 }
 
 static int emitJump(uint8_t instruction)
 {
+	if (current->wideJumps)
+	{
+		emitBytes(OP_WIDE, instruction);
+		emitLong(WIDE_MAX);
+		return currentChunk()->count - 3;
+	}
+
 	emitByte(instruction);
 	emitByte(0xff);
 	emitByte(0xff);
@@ -214,31 +310,204 @@ static void	emitReturn()
 	emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value)
+static bool isSharedConstant(Value value)
+{
+	return IS_NUMBER(value) || IS_STRING(value) || IS_SHORT_STRING(value); // Strings are interned, so the same string is the same object
+}
+
+// Numbers match bit for bit, so 0 and -0 stay apart
+static bool sameConstant(Value a, Value b)
+{
+#ifdef NAN_BOXING
+	return a == b;
+#else
+	if (a.type != b.type)
+		return false;
+
+	switch (a.type)
+	{
+	case VAL_NUMBER: return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+	case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+	case VAL_SHORT_STRING: return SHORT_STRING_PAYLOAD(a) == SHORT_STRING_PAYLOAD(b);
+	default: return false;
+	}
+#endif
+}
+
+static uint32_t hashConstant(Value value)
+{
+#ifdef NAN_BOXING
+	uint64_t bits = value;
+#else
+	uint64_t bits;
+	if (IS_NUMBER(value))
+		memcpy(&bits, &value.as.number, sizeof(double));
+	else if (IS_OBJ(value))
+		bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+	else
+		bits = SHORT_STRING_PAYLOAD(value);
+#endif
+
+	// Mix the high bits down, since a number's low bits are often all zero
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdULL;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
+// The slot holding value's pool index, or the empty slot it would go in
+// Code that was thrown away can leave indexes past the end of the pool, or to a different constant. Those just never match
+static int* findConstantSlot(Value value)
+{
+	ValueArray* constants = &currentChunk()->constants;
+	int mask = current->constantSetCapacity - 1; // Capacity is always a power of 2
+
+	for (uint32_t i = hashConstant(value) & mask;; i = (i + 1) & mask)
+	{
+		int* slot = &current->constantSet[i];
+		if (*slot == -1 || (*slot < constants->count && sameConstant(constants->values[*slot], value)))
+			return slot;
+	}
+}
+
+// Rebuilt from the pool itself, which also drops whatever was thrown away since
+static void growConstantSet()
+{
+	FREE_ARRAY(int, current->constantSet, current->constantSetCapacity);
+	current->constantSetCapacity = GROW_CAPACITY(current->constantSetCapacity);
+	current->constantSet = ALLOCATE(int, current->constantSetCapacity);
+	current->constantSetCount = 0;
+	for (int i = 0; i < current->constantSetCapacity; i++)
+	{
+		current->constantSet[i] = -1;
+	}
+
+	ValueArray* constants = &currentChunk()->constants;
+	for (int i = 0; i < constants->count; i++)
+	{
+		if (!isSharedConstant(constants->values[i]))
+			continue;
+
+		int* slot = findConstantSlot(constants->values[i]);
+		if (*slot == -1)
+		{
+			*slot = i;
+			current->constantSetCount++;
+		}
+	}
+}
+
+static int makeConstant(Value value)
 {
+	bool shared = isSharedConstant(value);
+	int* slot = NULL;
+	if (shared && current->constantSetCapacity > 0)
+	{
+		slot = findConstantSlot(value);
+		if (*slot != -1)
+			return *slot;
+	}
+
+	// In the pool first, so the GC can see it before the set allocates
 	int constant = addConstant(currentChunk(), value);
-	if (constant > UINT8_MAX)
+	if (shared)
+	{
+		if (current->constantSetCount + 1 > current->constantSetCapacity * 3 / 4)
+		{
+			growConstantSet(); // Picks the new constant up from the pool
+		}
+		else
+		{
+			*slot = constant;
+			current->constantSetCount++;
+		}
+	}
+
+	if (constant > WIDE_MAX)
 	{
 		error("Too many constants in one chunk.");
 		return 0;
 	}
 
-	return (uint8_t)constant;
+	return constant;
 }
 
+// Literals and folded expressions both come through here
 static void emitConstant(Value value)
 {
-	emitBytes(OP_CONSTANT, makeConstant(value));
+	FoldableConstant* constant = &current->lastConstant;
+	constant->start = currentChunk()->count;
+	constant->constantCount = currentChunk()->constants.count;
+	constant->value = value;
+
+	if (IS_NIL(value))
+		emitByte(OP_NIL);
+	else if (IS_BOOL(value))
+		emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	else
+	{
+		int index = makeConstant(value);
+		if (index <= UINT8_MAX)
+		{
+			emitBytes(OP_CONSTANT, (uint8_t)index);
+		}
+		else
+		{
+			emitByte(OP_CONSTANT_LONG);
+			emitLong(index);
+		}
+	}
+
+	constant->end = currentChunk()->count;
+}
+
+// True if everything from start to the end of the chunk is a single constant load that no jump lands inside of
+static bool constantAt(int start, FoldableConstant* constant)
+{
+	*constant = current->lastConstant;
+	return constant->start == start && constant->end == currentChunk()->count && current->lastJumpTarget <= start;
+}
+
+// Throws away the code from start onward, and the constants only it used
+static void discardCode(int start, int constantCount)
+{
+	currentChunk()->count = start;
+	currentChunk()->constants.count = constantCount;
+
+	// Along with the lines that start in it
+	LineTable* lines = &currentChunk()->lines;
+	while (lines->count > 0 && lines->starts[lines->count - 1].offset >= start)
+		lines->count--;
+
+	if (current->lastJumpTarget > start)
+		current->lastJumpTarget = start;
+	if (current->lastConstant.end > start)
+		current->lastConstant.end = -1;
 }
 
 static void	patchJump(int offset)
 {
+	current->lastJumpTarget = currentChunk()->count;
+
+	if (current->wideJumps)
+	{
+		int jump = currentChunk()->count - offset - 3;
+		if (jump > WIDE_MAX)
+			error("Too much code to jump over.");
+
+		currentChunk()->code[offset] = (jump >> 16) & 0xff;
+		currentChunk()->code[offset + 1] = (jump >> 8) & 0xff;
+		currentChunk()->code[offset + 2] = jump & 0xff;
+		return;
+	}
+
 	// -2 to account for the bytecode of the jump
 	int jump = currentChunk()->count - offset - 2;
 
 	if (jump > UINT16_MAX)
 	{
-		error("Too much code to jump over.");
+		current->jumpTooFar = true; // Finish the function anyway. It gets thrown away and compiled again
+		return;
 	}
 
 	// Split into 2 1-byte pieces
@@ -246,24 +515,63 @@ static void	patchJump(int offset)
 	currentChunk()->code[offset + 1] = jump & 0xff; // Take last 8 bits of the value
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type)
+static Local* newLocal()
+{
+	if (current->localCount == current->localCapacity)
+	{
+		int oldCapacity = current->localCapacity;
+		current->localCapacity = GROW_CAPACITY(oldCapacity);
+		current->locals = GROW_ARRAY(Local, current->locals, oldCapacity, current->localCapacity);
+	}
+
+	if (current->localCount == current->function->localCount)
+		current->function->localCount++;
+	return &current->locals[current->localCount++];
+}
+
+// function is NULL for a new one, or a lazy function whose body is being compiled
+static void initCompiler(Compiler* compiler, FunctionType type, bool wideJumps, ObjFunction* function)
 {
 	compiler->enclosing = current;
 	compiler->function = NULL; // Garbage-collection related paranoia, since it's near-immediately reassigned
 	compiler->type = type;
 
+	compiler->locals = NULL;
 	compiler->localCount = 0;
+	compiler->localCapacity = 0;
+	compiler->upvalues = NULL;
+	compiler->upvalueCapacity = 0;
+	compiler->constantSet = NULL;
+	compiler->constantSetCount = 0;
+	compiler->constantSetCapacity = 0;
 	compiler->scopeDepth = 0;
-	compiler->function = newFunction();
+	compiler->wideJumps = wideJumps;
+	compiler->jumpTooFar = false;
+	compiler->lastConstant.end = -1;
+	compiler->lastJumpTarget = 0;
+	compiler->operandStart = 0;
+	compiler->unreachable = false;
+	compiler->function = function != NULL ? function : newFunction();
 
 	current = compiler;
 
-	if (type != TYPE_SCRIPT)
+	if (function != NULL)
+	{
+		// Its upvalues were settled when it was declared, and the closures already made have them
+		LazyFunction* lazy = function->lazy;
+		compiler->upvalueCapacity = function->upvalueCount;
+		compiler->upvalues = ALLOCATE(Upvalue, compiler->upvalueCapacity);
+		for (int i = 0; i < function->upvalueCount; i++)
+		{
+			compiler->upvalues[i] = lazy->upvalues[i];
+		}
+	}
+	else if (type != TYPE_SCRIPT)
 	{
 		current->function->name = copyString(parser.previous.start, parser.previous.length);
 	}
 
-	Local* local = &current->locals[current->localCount++];
+	Local* local = newLocal();
 	local->depth = 0;
 	local->isCaptured = false;
 	if (type != TYPE_FUNCTION)
@@ -280,20 +588,36 @@ static void initCompiler(Compiler* compiler, FunctionType type)
 
 static ObjFunction* endCompiler()
 {
-	emitReturn();
+	if (!current->unreachable)
+		emitReturn();
 	ObjFunction* function = current->function;
 
+	if (!parser.hadError && !current->jumpTooFar)
+	{
+		if (optimizeIR)
+			optimizeFunction(function);
+		optimizeChunk(currentChunk());
+	}
+
 #ifdef DEBUG_PRINT_CODE
-	if (!parser.hadError)
+	if (!parser.hadError && !current->jumpTooFar)
 	{
 		disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
 	}
 #endif
 
+	freezeChunk(currentChunk());
 	current = current->enclosing;
 	return function;
 }
 
+static void freeCompiler(Compiler* compiler)
+{
+	FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+	FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+	FREE_ARRAY(int, compiler->constantSet, compiler->constantSetCapacity);
+}
+
 static void	beginScope()
 {
 	current->scopeDepth++;
@@ -316,17 +640,182 @@ static void endScope()
 static void expression();
 static void	statement();
 static void	declaration();
-static uint8_t identifierConstant(Token* name);
+static int identifierConstant(Token* name);
+static bool identifiersEqual(Token* a, Token* b);
 static ParseRule* getRule(TokenType type);
 static void	parsePrecedence(Precedence precedence);
 static uint8_t argumentList();
 
+static bool isFalseyConstant(Value value)
+{
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Evaluates an operator on two constants the same way the VM would. Anything that would be a runtime error is left to the VM
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result)
+{
+	switch (operatorType)
+	{
+	case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+	case TOKEN_BANG_EQUAL: *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+	default: break;
+	}
+
+	if (operatorType == TOKEN_PLUS && IS_STRING_LIKE(a) && IS_STRING_LIKE(b))
+	{
+		char bufferA[SHORT_STRING_MAX], bufferB[SHORT_STRING_MAX];
+		int lengthA, lengthB;
+		const char* charsA = stringChars(a, bufferA, &lengthA);
+		const char* charsB = stringChars(b, bufferB, &lengthB);
+
+		int length = lengthA + lengthB;
+		char* chars = ALLOCATE(char, length + 1);
+		memcpy(chars, charsA, lengthA);
+		memcpy(chars + lengthA, charsB, lengthB);
+
+		*result = copyStringValue(chars, length); // a and b are still in the constant pool, so they're safe from the GC here
+		FREE_ARRAY(char, chars, length + 1);
+		return true;
+	}
+
+	if (!IS_NUMBER(a) || !IS_NUMBER(b))
+		return false;
+
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+	switch (operatorType)
+	{
+	case TOKEN_GREATER: *result = BOOL_VAL(x > y); break;
+	case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); break; // Matches OP_LESS, OP_NOT
+	case TOKEN_LESS: *result = BOOL_VAL(x < y); break;
+	case TOKEN_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); break;
+	case TOKEN_PLUS: *result = NUMBER_VAL(x + y); break;
+	case TOKEN_MINUS: *result = NUMBER_VAL(x - y); break;
+	case TOKEN_STAR: *result = NUMBER_VAL(x * y); break;
+	case TOKEN_SLASH: *result = NUMBER_VAL(x / y); break;
+	default: return false;
+	}
+
+	return true;
+}
+
+// Replaces "left, right" with their folded result if the right operand compiled to a constant too
+static bool foldOperands(TokenType operatorType, FoldableConstant* left, int rightStart)
+{
+	FoldableConstant right;
+	Value result;
+	if (!constantAt(rightStart, &right) || !foldBinary(operatorType, left->value, right.value, &result))
+		return false;
+
+	discardCode(left->start, left->constantCount);
+	emitConstant(result);
+	return true;
+}
+
+// Whether the operand about to be compiled is just a literal or a local, so running it can't fail or have side effects
+// Anything else has to wait until the + before it has checked its operands, like it would without OP_CONCAT_N
+static bool isPlainOperand()
+{
+	switch (parser.current.type)
+	{
+	case TOKEN_NUMBER:
+	case TOKEN_STRING:
+	case TOKEN_TRUE:
+	case TOKEN_FALSE:
+	case TOKEN_NIL:
+		break;
+	case TOKEN_IDENTIFIER:
+	{
+		int local = current->localCount - 1;
+		while (local >= 0 && !identifiersEqual(&parser.current, &current->locals[local].name))
+			local--;
+		if (local < 0 || current->locals[local].depth == -1)
+			return false; // A global or upvalue, or an error the operand reports itself
+		break;
+	}
+	default:
+		return false;
+	}
+
+	// Look one token further, in case the operand goes on past it, like a call or a * does
+	Scanner saved = scanner;
+	Token next = scanToken();
+	scanner = saved;
+
+	return next.type != TOKEN_STAR && next.type != TOKEN_SLASH && next.type != TOKEN_DOT && next.type != TOKEN_LEFT_PAREN;
+}
+
+// Adds up the operands on the stack, reporting errors at the given line
+static void sumChain(int operandCount, int line)
+{
+	if (operandCount == 2)
+	{
+		writeChunk(currentChunk(), OP_ADD, line);
+		return;
+	}
+
+	writeChunk(currentChunk(), OP_CONCAT_N, line);
+	writeChunk(currentChunk(), (uint8_t)operandCount, line);
+}
+
+// Left-associative + chains (a + b + c ...) become one OP_CONCAT_N, so a string is built with a single allocation
+// Constant operands at the start of the chain are folded together
+static void addChain(FoldableConstant* left, int rightStart)
+{
+	int operandCount = 2; // Left operand is already on the stack, and binary() compiled the right one
+	if (left != NULL && foldOperands(TOKEN_PLUS, left, rightStart))
+		operandCount = 1;
+
+	// Each OP_ADD would have been on its right operand's line, so only operands on the same line as the first one are fused
+	// That way a type error anywhere in the fused part is still reported at the line the separate + would have used
+	int chainLine = parser.previous.line;
+
+	while (match(TOKEN_PLUS))
+	{
+		if (operandCount == UINT8_MAX || (operandCount > 1 && (parser.current.line != chainLine || !isPlainOperand())))
+		{
+			sumChain(operandCount, chainLine);
+			operandCount = 1; // The partial sum is the new left operand
+		}
+
+		// While everything so far has been folded, the sum is the last constant emitted
+		FoldableConstant sum;
+		bool sumIsConstant = operandCount == 1 && constantAt(current->lastConstant.start, &sum);
+
+		int operandStart = currentChunk()->count;
+		parsePrecedence(PREC_FACTOR);
+
+		if (sumIsConstant && foldOperands(TOKEN_PLUS, &sum, operandStart))
+			continue;
+		if (++operandCount == 2)
+			chainLine = parser.previous.line;
+	}
+
+	if (operandCount == 1)
+		return; // Folded down to a single constant
+	sumChain(operandCount, chainLine);
+}
+
 static void binary(bool canAssign)
 {
 	TokenType operatorType = parser.previous.type;
 	ParseRule* rule = getRule(operatorType);
+
+	FoldableConstant left;
+	bool leftIsConstant = constantAt(current->operandStart, &left);
+
+	int rightStart = currentChunk()->count;
 	parsePrecedence((Precedence)rule->precedence + 1);
 
+	if (operatorType == TOKEN_PLUS)
+	{
+		addChain(leftIsConstant ? &left : NULL, rightStart);
+		return;
+	}
+
+	if (leftIsConstant && foldOperands(operatorType, &left, rightStart))
+		return;
+
 	switch (operatorType)
 	{
 	case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
@@ -335,7 +824,6 @@ static void binary(bool canAssign)
 	case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
 	case TOKEN_LESS: emitByte(OP_LESS); break;
 	case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
-	case TOKEN_PLUS:  emitByte(OP_ADD); break;
 	case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
 	case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
 	case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
@@ -352,22 +840,22 @@ static void	call(bool canAssign)
 static void dot(bool canAssign)
 {
 	consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-	uint8_t name = identifierConstant(&parser.previous);
+	int name = identifierConstant(&parser.previous);
 
 	if (canAssign && match(TOKEN_EQUAL))
 	{
 		expression();
-		emitBytes(OP_SET_PROPERTY, name);
+		emitIndexed(OP_SET_PROPERTY, name);
 	}
 	else if (match(TOKEN_LEFT_PAREN))
 	{
 		uint8_t argCount = argumentList();
-		emitBytes(OP_INVOKE, name);
+		emitIndexed(OP_INVOKE, name);
 		emitByte(argCount);
 	}
 	else
 	{
-		emitBytes(OP_GET_PROPERTY, name);
+		emitIndexed(OP_GET_PROPERTY, name);
 	}
 }
 
@@ -375,9 +863,9 @@ static void literal(bool canAssign)
 {
 	switch (parser.previous.type)
 	{
-	case TOKEN_FALSE: emitByte(OP_FALSE); break;
-	case TOKEN_TRUE: emitByte(OP_TRUE); break;
-	case TOKEN_NIL: emitByte(OP_NIL); break;
+	case TOKEN_FALSE: emitConstant(BOOL_VAL(false)); break;
+	case TOKEN_TRUE: emitConstant(BOOL_VAL(true)); break;
+	case TOKEN_NIL: emitConstant(NIL_VAL); break;
 	default: return; // Unreachable
 	}
 }
@@ -390,7 +878,16 @@ static void grouping(bool canAssign)
 
 static void number(bool canAssign)
 {
-	double value = strtod(parser.previous.start, NULL);
+	// strtod() needs a '\0' after the digits, and there isn't always one in a mapped source
+	char buffer[64];
+	int length = parser.previous.length;
+	char* chars = length < (int)sizeof(buffer) ? buffer : ALLOCATE(char, length + 1);
+	memcpy(chars, parser.previous.start, length);
+	chars[length] = '\0';
+
+	double value = strtod(chars, NULL);
+	if (chars != buffer)
+		FREE_ARRAY(char, chars, length + 1);
 	emitConstant(NUMBER_VAL(value));
 }
 
@@ -420,7 +917,7 @@ static void and_(bool canAssign)
 static void string(bool canAssign)
 {
 	// +1 and -2 trim the quotation marks
-	emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+	emitConstant(copyStringValue(parser.previous.start + 1, parser.previous.length - 2));
 }
 
 static void	namedVariable(Token name, bool canAssign)
@@ -449,11 +946,11 @@ static void	namedVariable(Token name, bool canAssign)
 	if (canAssign && match(TOKEN_EQUAL))
 	{
 		expression();
-		emitBytes(setOp, (uint8_t)arg);
+		emitIndexed(setOp, arg);
 	}
 	else
 	{
-		emitBytes(getOp, (uint8_t)arg);
+		emitIndexed(getOp, arg);
 	}
 }
 
@@ -483,20 +980,20 @@ static void super_(bool canAssign)
 
 	consume(TOKEN_DOT, "Expect '.' after 'super'.");
 	consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-	uint8_t name = identifierConstant(&parser.previous);
+	int name = identifierConstant(&parser.previous);
 
 	namedVariable(syntheticToken("this"), false);
 	if (match(TOKEN_LEFT_PAREN))
 	{
 		uint8_t	argCount = argumentList();
 		namedVariable(syntheticToken("super"), false);
-		emitBytes(OP_SUPER_INVOKE, name);
+		emitIndexed(OP_SUPER_INVOKE, name);
 		emitByte(argCount);
 	}
 	else
 	{
 		namedVariable(syntheticToken("super"), false);
-		emitBytes(OP_GET_SUPER, name);
+		emitIndexed(OP_GET_SUPER, name);
 	}
 }
 
@@ -516,8 +1013,27 @@ static void unary(bool canAssign)
 	TokenType operatorType = parser.previous.type;
 
 	// Compile the operand
+	int operandStart = currentChunk()->count;
 	parsePrecedence(PREC_UNARY); // Use PREC_UNARY to allow nesting unary operators (ex: !!a)
 
+	FoldableConstant operand;
+	if (constantAt(operandStart, &operand))
+	{
+		if (operatorType == TOKEN_BANG)
+		{
+			discardCode(operandStart, operand.constantCount);
+			emitConstant(BOOL_VAL(isFalseyConstant(operand.value)));
+			return;
+		}
+
+		if (operatorType == TOKEN_MINUS && IS_NUMBER(operand.value))
+		{
+			discardCode(operandStart, operand.constantCount);
+			emitConstant(NUMBER_VAL(-AS_NUMBER(operand.value)));
+			return;
+		}
+	}
+
 	// Emit the operator instruction
 	switch (operatorType)
 	{
@@ -580,6 +1096,7 @@ static void	parsePrecedence(Precedence precedence)
 		return;
 	}
 
+	int start = currentChunk()->count;
 	bool canAssign = precedence <= PREC_ASSIGNMENT;
 	prefixRule(canAssign);
 
@@ -587,6 +1104,7 @@ static void	parsePrecedence(Precedence precedence)
 	{
 		advance();
 		ParseFn	infixRule = getRule(parser.previous.type)->infix;
+		current->operandStart = start; // Everything since start is the left operand
 		infixRule(canAssign);
 	}
 
@@ -594,7 +1112,7 @@ static void	parsePrecedence(Precedence precedence)
 		error("Invalid assignment target.");
 }
 
-static uint8_t identifierConstant(Token* name)
+static int identifierConstant(Token* name)
 {
 	return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
@@ -625,7 +1143,7 @@ static int resolveLocal(Compiler* compiler, Token* name)
 	return -1; // Global
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
+static int addUpvalue(Compiler* compiler, int index, bool isLocal, Token* name)
 {
 	int upvalueCount = compiler->function->upvalueCount;
 
@@ -639,34 +1157,50 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
 		}
 	}
 
-	if (upvalueCount == UINT8_COUNT)
+	if (upvalueCount == UINT16_COUNT)
 	{
 		error("Too many closure variables in function.");
 		return 0;
 	}
 
+	if (upvalueCount == compiler->upvalueCapacity)
+	{
+		int oldCapacity = compiler->upvalueCapacity;
+		compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+		compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+	}
+
 	compiler->upvalues[upvalueCount].isLocal = isLocal;
 	compiler->upvalues[upvalueCount].index = index;
+	compiler->upvalues[upvalueCount].name = *name;
 	return compiler->function->upvalueCount++;
 }
 
 static int resolveUpvalue(Compiler* compiler, Token* name)
 {
 	if (compiler->enclosing == NULL)
+	{
+		// A body compiled on its first call can only use what it captured when it was declared
+		for (int i = 0; i < compiler->function->upvalueCount; i++)
+		{
+			if (identifiersEqual(name, &compiler->upvalues[i].name))
+				return i;
+		}
 		return -1;
+	}
 
 	int local = resolveLocal(compiler->enclosing, name);
 	if (local != -1)
 	{
 		compiler->enclosing->locals[local].isCaptured = true;
-		return addUpvalue(compiler, (uint8_t)local, true);
+		return addUpvalue(compiler, local, true, name);
 	}
 
 	// Get values from outside the immediately enclosing scope
 	int upvalue = resolveUpvalue(compiler->enclosing, name);
 	if (upvalue != -1)
 	{
-		return addUpvalue(compiler, (uint8_t)upvalue, false);
+		return addUpvalue(compiler, upvalue, false, name);
 	}
 
 	return -1;
@@ -674,13 +1208,13 @@ static int resolveUpvalue(Compiler* compiler, Token* name)
 
 static void addLocal(Token name)
 {
-	if (current->localCount == UINT8_COUNT)
+	if (current->localCount == UINT16_COUNT)
 	{
 		error("Too many local variables in function.");
 		return;
 	}
 
-	Local* local = &current->locals[current->localCount++];
+	Local* local = newLocal();
 	local->name = name;
 	local->depth = -1;
 	local->isCaptured = false;
@@ -711,7 +1245,7 @@ static void declareVariable()
 	addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage)
+static int parseVariable(const char* errorMessage)
 {
 	consume(TOKEN_IDENTIFIER, errorMessage);
 
@@ -729,7 +1263,7 @@ static void markInitialized()
 	current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(int global)
 {
 	if (current->scopeDepth > 0)
 	{
@@ -738,7 +1272,7 @@ static void defineVariable(uint8_t global)
 		return;
 	}
 
-	emitBytes(OP_DEFINE_GLOBAL, global);
+	emitIndexed(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList()
@@ -773,80 +1307,817 @@ static void expression()
 	parsePrecedence(PREC_ASSIGNMENT);
 }
 
+// Compiles code that can never run, only to report its errors, then throws it away
+static void compileDead(void (*compileFn)())
+{
+	int start = currentChunk()->count;
+	int constantCount = currentChunk()->constants.count;
+	bool unreachable = current->unreachable;
+
+	compileFn();
+
+	discardCode(start, constantCount);
+	current->unreachable = unreachable;
+}
+
 static void block()
 {
 	while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
 	{
-		declaration();
+		// Nothing after a return in the same block can run
+		if (current->unreachable)
+			compileDead(declaration);
+		else
+			declaration();
 	}
 
 	consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type)
+// Getters and setters are recognised from their finished code, so any way of writing them counts
+static void markAccessor(ObjFunction* function)
 {
-	Compiler compiler;
-	initCompiler(&compiler, type);
-	beginScope(); // Don't have to end scope since we discard the compiler afterwards
-
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+	uint8_t* code = function->chunk.code;
+	int count = function->chunk.count;
 
-	// Parse parameters
-	if (!check(TOKEN_RIGHT_PAREN))
+	// OP_GET_LOCAL 0, OP_GET_PROPERTY field, OP_RETURN
+	if (function->arity == 0 && count == 5 && code[0] == OP_GET_LOCAL && code[1] == 0 &&
+		code[2] == OP_GET_PROPERTY && code[4] == OP_RETURN)
 	{
-		do
-		{
-			current->function->arity++;
-			if (current->function->arity > 255)
-			{
-				errorAtCurrent("Can't have more than 255 parameters.");
-			}
-
-			uint8_t	constant = parseVariable("Expect parameter name.");
-			defineVariable(constant);
-		}
-		while (match(TOKEN_COMMA));
+		function->accessor = ACCESSOR_GETTER;
+		function->accessorField = code[3];
 	}
 
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	// OP_GET_LOCAL 0, OP_GET_LOCAL 1, OP_SET_PROPERTY field, OP_POP, OP_NIL, OP_RETURN
+	if (function->arity == 1 && count == 9 && code[0] == OP_GET_LOCAL && code[1] == 0 && code[2] == OP_GET_LOCAL && code[3] == 1 &&
+		code[4] == OP_SET_PROPERTY && code[6] == OP_POP && code[7] == OP_NIL && code[8] == OP_RETURN)
+	{
+		function->accessor = ACCESSOR_SETTER;
+		function->accessorField = code[5];
+	}
+}
 
-	block();
+// Emits the OP_CLOSURE that makes a closure of function
+static void closure(ObjFunction* function, Upvalue* upvalues)
+{
+	// Upvalue indexes get three bytes too if the constant does, or if any of them needs it
+	int constant = makeConstant(OBJ_VAL(function));
+	bool wide = constant > UINT8_MAX;
+	for (int i = 0; i < function->upvalueCount; i++)
+	{
+		wide |= upvalues[i].index > UINT8_MAX;
+	}
 
-	ObjFunction* function = endCompiler();
-	emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+	if (wide)
+	{
+		emitBytes(OP_WIDE, OP_CLOSURE);
+		emitLong(constant);
+	}
+	else
+	{
+		emitBytes(OP_CLOSURE, (uint8_t)constant);
+	}
 
 	for (int i = 0; i < function->upvalueCount; i++)
 	{
-		emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-		emitByte(compiler.upvalues[i].index);
+		emitByte(upvalues[i].isLocal ? 1 : 0);
+		if (wide)
+			emitLong(upvalues[i].index);
+		else
+			emitByte((uint8_t)upvalues[i].index);
 	}
 }
 
-static void method()
+static void truncateFinished(int count)
 {
-	consume(TOKEN_IDENTIFIER, "Expect method name.");
-	uint8_t	constant = identifierConstant(&parser.previous);
-
-	FunctionType type = TYPE_METHOD;
-	if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0)
+	for (int i = count; i < finishedCount; i++)
 	{
-		type = TYPE_INITIALIZER;
+		FREE_ARRAY(Upvalue, finished[i].upvalues, finished[i].function->upvalueCount);
 	}
-
-	function(type);
-
-	emitBytes(OP_METHOD, constant);
+	finishedCount = count;
 }
 
-static void	classDeclaration()
+static void addFinished(const char* start, ObjFunction* function, Upvalue* upvalues)
+{
+	if (finishedCount == finishedCapacity)
+	{
+		int oldCapacity = finishedCapacity;
+		finishedCapacity = GROW_CAPACITY(oldCapacity);
+		finished = GROW_ARRAY(FinishedFunction, finished, oldCapacity, finishedCapacity);
+	}
+
+	FinishedFunction* entry = &finished[finishedCount++];
+	entry->start = start;
+	entry->function = function;
+	entry->upvalues = ALLOCATE(Upvalue, function->upvalueCount);
+	for (int i = 0; i < function->upvalueCount; i++)
+	{
+		entry->upvalues[i] = upvalues[i];
+	}
+	entry->parserEnd = parser;
+	entry->scannerEnd = scanner;
+}
+
+static FinishedFunction* findFinished(const char* start)
+{
+	int low = 0;
+	int high = finishedCount - 1;
+	while (low <= high)
+	{
+		int middle = (low + high) / 2;
+		if (finished[middle].start == start)
+			return &finished[middle];
+		if (finished[middle].start < start)
+			low = middle + 1;
+		else
+			high = middle - 1;
+	}
+
+	return NULL;
+}
+
+static void freeFinished()
+{
+	truncateFinished(0);
+	FREE_ARRAY(FinishedFunction, finished, finishedCapacity);
+	finished = NULL;
+	finishedCapacity = 0;
+}
+
+// Captures what it captured the first time, so the enclosing functions get the same upvalues and captured locals again
+static void reuseFinished(FinishedFunction* entry)
+{
+	for (int i = 0; i < entry->function->upvalueCount; i++)
+	{
+		Upvalue* upvalue = &entry->upvalues[i];
+		if (upvalue->isLocal)
+			current->locals[upvalue->index].isCaptured = true;
+		else
+			resolveUpvalue(current, &upvalue->name);
+	}
+
+	parser = entry->parserEnd;
+	scanner = entry->scannerEnd;
+}
+
+// Parameters and body, once the function's name has been consumed
+static ObjFunction* functionBody(Compiler* compiler, FunctionType type, bool wideJumps, ObjFunction* function)
+{
+	initCompiler(compiler, type, wideJumps, function);
+	beginScope(); // Don't have to end scope since we discard the compiler afterwards
+
+	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+
+	// Parse parameters
+	if (!check(TOKEN_RIGHT_PAREN))
+	{
+		do
+		{
+			current->function->arity++;
+			if (current->function->arity > 255)
+			{
+				errorAtCurrent("Can't have more than 255 parameters.");
+			}
+
+			int constant = parseVariable("Expect parameter name.");
+			defineVariable(constant);
+		}
+		while (match(TOKEN_COMMA));
+	}
+
+	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+
+	block();
+
+	return endCompiler();
+}
+
+// Skipping: a lazy function's body is only parsed when it's declared, to report its errors on time and find what it captures
+// Same grammar as above, but nothing is made - no code, constants or strings. Where it can't be sure, the body is compiled instead,
+// so any error comes out exactly as it would have
+
+typedef struct
+{
+	Token name;
+	int depth; // -1 until initialized, like Local
+} SkippedLocal;
+
+typedef struct
+{
+	SkippedLocal* locals; // Of every function being skipped, innermost last
+	int localCount;
+	int localCapacity;
+	int functionStart; // First local of the innermost one
+	int scopeDepth;
+	FunctionType type;
+	Compiler* compiler; // Of the lazy function. Names none of the skipped functions declare are captured through it
+	bool failed;
+} Skipper;
+
+Skipper skipper;
+
+static void skipToken()
+{
+	parser.previous = parser.current;
+	parser.current = scanToken();
+	if (parser.current.type == TOKEN_ERROR)
+		skipper.failed = true;
+}
+
+static bool skipMatch(TokenType type)
+{
+	if (skipper.failed || parser.current.type != type)
+		return false;
+
+	skipToken();
+	return true;
+}
+
+static void skipConsume(TokenType type)
+{
+	if (!skipMatch(type))
+		skipper.failed = true;
+}
+
+static void addSkippedLocal(Token name, int depth)
+{
+	if (skipper.localCount - skipper.functionStart == UINT16_COUNT)
+	{
+		skipper.failed = true;
+		return;
+	}
+
+	if (skipper.localCount == skipper.localCapacity)
+	{
+		int oldCapacity = skipper.localCapacity;
+		skipper.localCapacity = GROW_CAPACITY(oldCapacity);
+		skipper.locals = GROW_ARRAY(SkippedLocal, skipper.locals, oldCapacity, skipper.localCapacity);
+	}
+
+	skipper.locals[skipper.localCount].name = name;
+	skipper.locals[skipper.localCount].depth = depth;
+	skipper.localCount++;
+}
+
+// Like declareVariable(). Always a local, since it's inside a function
+static void declareSkipped(Token name)
+{
+	for (int i = skipper.localCount - 1; i >= skipper.functionStart; i--)
+	{
+		SkippedLocal* local = &skipper.locals[i];
+		if (local->depth != -1 && local->depth < skipper.scopeDepth)
+			break;
+
+		if (identifiersEqual(&name, &local->name))
+			skipper.failed = true;
+	}
+
+	addSkippedLocal(name, -1);
+}
+
+static void markSkippedInitialized()
+{
+	if (skipper.localCount > skipper.functionStart)
+		skipper.locals[skipper.localCount - 1].depth = skipper.scopeDepth;
+}
+
+static void skipEndScope()
+{
+	skipper.scopeDepth--;
+	while (skipper.localCount > skipper.functionStart && skipper.locals[skipper.localCount - 1].depth > skipper.scopeDepth)
+	{
+		skipper.localCount--;
+	}
+}
+
+// A name some skipped code uses. If no skipped function declares it, the lazy function has to capture it now, like resolveUpvalue() would
+static void skipName(Token* name)
+{
+	for (int i = skipper.localCount - 1; i >= 0; i--)
+	{
+		if (identifiersEqual(name, &skipper.locals[i].name))
+		{
+			if (skipper.locals[i].depth == -1)
+				skipper.failed = true; // Read in its own initializer
+			return;
+		}
+	}
+
+	resolveUpvalue(skipper.compiler, name);
+}
+
+static void skipExpression();
+static void skipStatement();
+static void skipDeclaration();
+static int skipFunction(FunctionType type);
+
+static void skipArguments()
+{
+	int argCount = 0;
+	if (parser.current.type != TOKEN_RIGHT_PAREN)
+	{
+		do
+		{
+			skipExpression();
+			argCount++;
+		}
+		while (skipMatch(TOKEN_COMMA));
+	}
+
+	if (argCount > 255)
+		skipper.failed = true;
+	skipConsume(TOKEN_RIGHT_PAREN);
+}
+
+static void skipPrecedence(Precedence precedence)
+{
+	if (skipper.failed)
+		return;
+
+	skipToken();
+	bool canAssign = precedence <= PREC_ASSIGNMENT;
+	switch (parser.previous.type)
+	{
+	case TOKEN_LEFT_PAREN:
+		skipExpression();
+		skipConsume(TOKEN_RIGHT_PAREN);
+		break;
+	case TOKEN_MINUS:
+	case TOKEN_BANG:
+		skipPrecedence(PREC_UNARY);
+		break;
+	case TOKEN_IDENTIFIER:
+	{
+		Token name = parser.previous;
+		skipName(&name);
+		if (canAssign && skipMatch(TOKEN_EQUAL))
+			skipExpression();
+		break;
+	}
+	case TOKEN_STRING:
+	case TOKEN_NUMBER:
+	case TOKEN_FALSE:
+	case TOKEN_TRUE:
+	case TOKEN_NIL:
+		break;
+	case TOKEN_SUPER:
+	{
+		if (currentClass == NULL || !currentClass->hasSuperclass)
+			skipper.failed = true;
+		skipConsume(TOKEN_DOT);
+		skipConsume(TOKEN_IDENTIFIER);
+
+		Token thisToken = syntheticToken("this");
+		Token superToken = syntheticToken("super");
+		skipName(&thisToken);
+		if (skipMatch(TOKEN_LEFT_PAREN))
+			skipArguments();
+		skipName(&superToken);
+		break;
+	}
+	case TOKEN_THIS:
+	{
+		if (currentClass == NULL)
+			skipper.failed = true;
+		Token name = parser.previous;
+		skipName(&name);
+		break;
+	}
+	default:
+		skipper.failed = true; // Expect expression
+		return;
+	}
+
+	while (!skipper.failed && precedence <= getRule(parser.current.type)->precedence)
+	{
+		skipToken();
+		switch (parser.previous.type)
+		{
+		case TOKEN_LEFT_PAREN:
+			skipArguments();
+			break;
+		case TOKEN_DOT:
+			skipConsume(TOKEN_IDENTIFIER);
+			if (canAssign && skipMatch(TOKEN_EQUAL))
+				skipExpression();
+			else if (skipMatch(TOKEN_LEFT_PAREN))
+				skipArguments();
+			break;
+		case TOKEN_AND:
+			skipPrecedence(PREC_AND);
+			break;
+		case TOKEN_OR:
+			skipPrecedence(PREC_OR);
+			break;
+		default:
+			skipPrecedence((Precedence)getRule(parser.previous.type)->precedence + 1);
+			break;
+		}
+	}
+
+	if (canAssign && skipMatch(TOKEN_EQUAL))
+		skipper.failed = true; // Invalid assignment target
+}
+
+static void skipExpression()
+{
+	skipPrecedence(PREC_ASSIGNMENT);
+}
+
+static void skipBlock()
+{
+	while (!skipper.failed && parser.current.type != TOKEN_RIGHT_BRACE && parser.current.type != TOKEN_EOF)
+	{
+		skipDeclaration();
+	}
+
+	skipConsume(TOKEN_RIGHT_BRACE);
+}
+
+static void skipVarDeclaration()
+{
+	skipConsume(TOKEN_IDENTIFIER);
+	declareSkipped(parser.previous);
+	if (skipMatch(TOKEN_EQUAL))
+		skipExpression();
+	skipConsume(TOKEN_SEMICOLON);
+	markSkippedInitialized();
+}
+
+static void skipClassDeclaration()
+{
+	skipConsume(TOKEN_IDENTIFIER);
+	Token className = parser.previous;
+	declareSkipped(className);
+	markSkippedInitialized();
+
+	ClassCompiler classCompiler;
+	classCompiler.enclosing = currentClass;
+	classCompiler.hasSuperclass = false;
+	currentClass = &classCompiler;
+
+	if (skipMatch(TOKEN_LESS))
+	{
+		skipConsume(TOKEN_IDENTIFIER);
+		Token superclass = parser.previous;
+		skipName(&superclass);
+		if (identifiersEqual(&className, &superclass))
+			skipper.failed = true;
+
+		skipper.scopeDepth++;
+		addSkippedLocal(syntheticToken("super"), skipper.scopeDepth);
+		classCompiler.hasSuperclass = true;
+	}
+
+	skipName(&className);
+	skipConsume(TOKEN_LEFT_BRACE);
+
+	while (!skipper.failed && parser.current.type != TOKEN_RIGHT_BRACE && parser.current.type != TOKEN_EOF)
+	{
+		skipConsume(TOKEN_IDENTIFIER);
+		bool isInit = parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0;
+		skipFunction(isInit ? TYPE_INITIALIZER : TYPE_METHOD);
+	}
+
+	skipConsume(TOKEN_RIGHT_BRACE);
+
+	if (classCompiler.hasSuperclass)
+		skipEndScope();
+
+	currentClass = currentClass->enclosing;
+}
+
+static void skipDeclaration()
+{
+	if (skipMatch(TOKEN_CLASS))
+	{
+		skipClassDeclaration();
+	}
+	else if (skipMatch(TOKEN_FUN))
+	{
+		skipConsume(TOKEN_IDENTIFIER);
+		declareSkipped(parser.previous);
+		markSkippedInitialized(); // Can call itself
+		skipFunction(TYPE_FUNCTION);
+	}
+	else if (skipMatch(TOKEN_VAR))
+	{
+		skipVarDeclaration();
+	}
+	else
+	{
+		skipStatement();
+	}
+}
+
+static void skipStatement()
+{
+	if (skipMatch(TOKEN_PRINT))
+	{
+		skipExpression();
+		skipConsume(TOKEN_SEMICOLON);
+	}
+	else if (skipMatch(TOKEN_IF))
+	{
+		skipConsume(TOKEN_LEFT_PAREN);
+		skipExpression();
+		skipConsume(TOKEN_RIGHT_PAREN);
+		skipStatement();
+		if (skipMatch(TOKEN_ELSE))
+			skipStatement();
+	}
+	else if (skipMatch(TOKEN_RETURN))
+	{
+		if (!skipMatch(TOKEN_SEMICOLON))
+		{
+			if (skipper.type == TYPE_INITIALIZER)
+				skipper.failed = true;
+			skipExpression();
+			skipConsume(TOKEN_SEMICOLON);
+		}
+	}
+	else if (skipMatch(TOKEN_WHILE))
+	{
+		skipConsume(TOKEN_LEFT_PAREN);
+		skipExpression();
+		skipConsume(TOKEN_RIGHT_PAREN);
+		skipStatement();
+	}
+	else if (skipMatch(TOKEN_FOR))
+	{
+		skipper.scopeDepth++;
+		skipConsume(TOKEN_LEFT_PAREN);
+		if (skipMatch(TOKEN_SEMICOLON))
+		{
+			// No initializer
+		}
+		else if (skipMatch(TOKEN_VAR))
+		{
+			skipVarDeclaration();
+		}
+		else
+		{
+			skipExpression();
+			skipConsume(TOKEN_SEMICOLON);
+		}
+
+		if (!skipMatch(TOKEN_SEMICOLON))
+		{
+			skipExpression();
+			skipConsume(TOKEN_SEMICOLON);
+		}
+
+		if (!skipMatch(TOKEN_RIGHT_PAREN))
+		{
+			skipExpression();
+			skipConsume(TOKEN_RIGHT_PAREN);
+		}
+
+		skipStatement();
+		skipEndScope();
+	}
+	else if (skipMatch(TOKEN_LEFT_BRACE))
+	{
+		skipper.scopeDepth++;
+		skipBlock();
+		skipEndScope();
+	}
+	else
+	{
+		skipExpression();
+		skipConsume(TOKEN_SEMICOLON);
+	}
+}
+
+// Parameters and body, like functionBody(). Returns the arity
+static int skipFunction(FunctionType type)
+{
+	int functionStart = skipper.functionStart;
+	int scopeDepth = skipper.scopeDepth;
+	FunctionType enclosingType = skipper.type;
+	skipper.functionStart = skipper.localCount;
+	skipper.scopeDepth = 1;
+	skipper.type = type;
+
+	addSkippedLocal(syntheticToken(type != TYPE_FUNCTION ? "this" : ""), 0);
+
+	int arity = 0;
+	skipConsume(TOKEN_LEFT_PAREN);
+	if (!skipper.failed && parser.current.type != TOKEN_RIGHT_PAREN)
+	{
+		do
+		{
+			if (++arity > 255)
+				skipper.failed = true;
+			skipConsume(TOKEN_IDENTIFIER);
+			declareSkipped(parser.previous);
+			markSkippedInitialized();
+		}
+		while (skipMatch(TOKEN_COMMA));
+	}
+
+	skipConsume(TOKEN_RIGHT_PAREN);
+	skipConsume(TOKEN_LEFT_BRACE);
+	skipBlock();
+
+	skipper.localCount = skipper.functionStart;
+	skipper.functionStart = functionStart;
+	skipper.scopeDepth = scopeDepth;
+	skipper.type = enclosingType;
+	return arity;
+}
+
+// Skips the body and leaves a stub that compiles it on the first call. NULL if the body has an error, for the compiler to report
+static ObjFunction* lazyFunction(Compiler* compiler, FunctionType type)
+{
+	Scanner scannerStart = scanner;
+	Token start = parser.current;
+	initCompiler(compiler, type, false, NULL);
+
+	skipper.locals = NULL;
+	skipper.localCount = 0;
+	skipper.localCapacity = 0;
+	skipper.functionStart = 0;
+	skipper.scopeDepth = 0;
+	skipper.type = type;
+	skipper.compiler = compiler;
+	skipper.failed = false;
+
+	int arity = skipFunction(type);
+	FREE_ARRAY(SkippedLocal, skipper.locals, skipper.localCapacity);
+
+	ObjFunction* function = compiler->function;
+	if (!skipper.failed)
+	{
+		// Still the current compiler's, so the GC can see it
+		LazyFunction* lazy = ALLOCATE(LazyFunction, 1);
+		lazy->type = type;
+		lazy->scanner = scannerStart;
+		lazy->start = start;
+		lazy->inClass = currentClass != NULL;
+		lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+		lazy->upvalues = ALLOCATE(Upvalue, function->upvalueCount);
+		for (int i = 0; i < function->upvalueCount; i++)
+		{
+			lazy->upvalues[i] = compiler->upvalues[i];
+		}
+
+		function->arity = arity;
+		function->lazy = lazy;
+		function->chunk.code = lazyStub;
+		function->chunk.count = function->chunk.capacity = 1;
+		function->chunk.storage = CHUNK_MAPPED;
+	}
+
+	current = compiler->enclosing;
+	return skipper.failed ? NULL : function;
+}
+
+bool compileLazyFunction(ObjFunction* function)
+{
+	LazyFunction* lazy = function->lazy;
+
+	// Only the innermost class matters, for this and super
+	ClassCompiler classCompiler;
+	classCompiler.enclosing = NULL;
+	classCompiler.hasSuperclass = lazy->hasSuperclass;
+	currentClass = lazy->inClass ? &classCompiler : NULL;
+
+	parser.hadError = false;
+	parser.panicMode = false;
+
+	Compiler compiler;
+	bool wideJumps = false;
+	for (;;)
+	{
+		scanner = lazy->scanner;
+		parser.current = lazy->start;
+		freeChunk(&function->chunk); // The stub, or the first try
+		function->arity = 0;
+		function->localCount = 0;
+
+		functionBody(&compiler, lazy->type, wideJumps, function);
+		if (!compiler.jumpTooFar || parser.hadError || wideJumps)
+			break;
+
+		freeCompiler(&compiler);
+		wideJumps = true;
+	}
+
+	freeCompiler(&compiler);
+	freeFinished();
+	currentClass = NULL;
+
+	if (parser.hadError)
+	{
+		// Left as a stub, so calling it again doesn't run half-compiled code
+		freeChunk(&function->chunk);
+		function->chunk.code = lazyStub;
+		function->chunk.count = function->chunk.capacity = 1;
+		function->chunk.storage = CHUNK_MAPPED;
+		return false;
+	}
+
+	if (lazy->type == TYPE_METHOD)
+		markAccessor(function);
+
+	freeLazyFunction(function);
+	return true;
+}
+
+void freeLazyFunction(ObjFunction* function)
+{
+	LazyFunction* lazy = function->lazy;
+	if (lazy == NULL)
+		return;
+
+	FREE_ARRAY(Upvalue, lazy->upvalues, function->upvalueCount);
+	FREE(LazyFunction, lazy);
+	function->lazy = NULL;
+}
+
+static ObjFunction* function(FunctionType type)
+{
+	// Jumps only get three-byte offsets in a function too big for two, found out by compiling it once. So remember where it starts
+	Parser parserStart = parser;
+	Scanner scannerStart = scanner;
+	const char* start = parser.current.start;
+	int finishedStart = finishedCount;
+
+	// The enclosing function is being compiled again with wide jumps, and this one was finished the first time
+	FinishedFunction* reused = current->wideJumps ? findFinished(start) : NULL;
+	if (reused != NULL)
+	{
+		reuseFinished(reused);
+		closure(reused->function, reused->upvalues);
+		return reused->function;
+	}
+
+	Compiler compiler;
+	ObjFunction* function = NULL;
+	if (lazyFunctions && !optimizeIR)
+	{
+		function = lazyFunction(&compiler, type);
+		if (function == NULL)
+		{
+			// Compiled after all, to report the error
+			freeCompiler(&compiler);
+			parser = parserStart;
+			scanner = scannerStart;
+		}
+	}
+
+	if (function == NULL)
+	{
+		function = functionBody(&compiler, type, false, NULL);
+		if (compiler.jumpTooFar && !parser.hadError)
+		{
+			freeCompiler(&compiler);
+			parser = parserStart;
+			scanner = scannerStart;
+			function = functionBody(&compiler, type, true, NULL);
+		}
+
+		if (type == TYPE_METHOD && !parser.hadError)
+			markAccessor(function);
+	}
+
+	closure(function, compiler.upvalues); // Its constant keeps it from the GC from here on
+
+	// Whatever was nested in it is part of it now. A retry only has to keep it if the enclosing function might need one
+	truncateFinished(finishedStart);
+	if (!current->wideJumps && !parser.hadError)
+		addFinished(start, function, compiler.upvalues);
+
+	freeCompiler(&compiler);
+	return function;
+}
+
+static void method()
+{
+	consume(TOKEN_IDENTIFIER, "Expect method name.");
+	int constant = identifierConstant(&parser.previous);
+
+	FunctionType type = TYPE_METHOD;
+	if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0)
+	{
+		type = TYPE_INITIALIZER;
+	}
+
+	function(type);
+
+	emitIndexed(OP_METHOD, constant);
+}
+
+static void	classDeclaration()
 {
 	consume(TOKEN_IDENTIFIER, "Expect class name.");
 	Token className = parser.previous;
-	uint8_t nameConstant = identifierConstant(&parser.previous);
+	int nameConstant = identifierConstant(&parser.previous);
 	declareVariable();
 
-	emitBytes(OP_CLASS, nameConstant);
+	emitIndexed(OP_CLASS, nameConstant);
 	defineVariable(nameConstant);
 
 	ClassCompiler classCompiler;
@@ -895,15 +2166,20 @@ static void	classDeclaration()
 
 static void funDeclaration()
 {
-	uint8_t global = parseVariable("Expect function name.");
+	int global = parseVariable("Expect function name.");
 	markInitialized(); // Mark initialized to allow recursion 
-	function(TYPE_FUNCTION);
+	ObjFunction* declared = function(TYPE_FUNCTION);
+
+	// Later calls to a top-level function might be inlined
+	if (optimizeIR && current->type == TYPE_SCRIPT && current->scopeDepth == 0 && !parser.hadError)
+		noteGlobalFunction(AS_STRING(currentChunk()->constants.values[global]), declared);
+
 	defineVariable(global);
 }
 
 static void varDeclaration()
 {
-	uint8_t global = parseVariable("Expect variable name.");
+	int global = parseVariable("Expect variable name.");
 
 	if (match(TOKEN_EQUAL))
 	{
@@ -919,12 +2195,82 @@ static void varDeclaration()
 	defineVariable(global);
 }
 
+// Whether the code from start is exactly local = local + n, for a whole n that fits in a byte
+static bool isIncrement(int start)
+{
+	Chunk* chunk = currentChunk();
+	uint8_t* code = chunk->code;
+	if (chunk->count != start + 7 || current->lastJumpTarget > start || code[start] != OP_GET_LOCAL || code[start + 2] != OP_CONSTANT ||
+		code[start + 4] != OP_ADD || code[start + 5] != OP_SET_LOCAL || code[start + 6] != code[start + 1])
+		return false;
+
+	Value amount = chunk->constants.values[code[start + 3]];
+	return IS_NUMBER(amount) && AS_NUMBER(amount) >= 1 && AS_NUMBER(amount) <= UINT8_MAX && AS_NUMBER(amount) == (int)AS_NUMBER(amount);
+}
+
+// Discards the value of the expression statement that starts at start
+// Nothing needs the value of local = local + n; then, so it becomes one instruction that adds to the local where it is
+static void popExpression(int start)
+{
+	if (!isIncrement(start))
+	{
+		emitByte(OP_POP);
+		return;
+	}
+
+	Chunk* chunk = currentChunk();
+	uint8_t slot = chunk->code[start + 1];
+	uint8_t amount = (uint8_t)AS_NUMBER(chunk->constants.values[chunk->code[start + 3]]);
+	bool ownsConstant = current->lastConstant.start == start + 2; // Only this expression uses it
+	discardCode(start, ownsConstant ? current->lastConstant.constantCount : chunk->constants.count);
+
+	emitBytes(OP_ADD_LOCAL, slot);
+	emitByte(amount);
+}
+
 // Expression statements are expressions followed by semicolons. Ex: execute a function, but discard its return.
 static void expressionStatement()
 {
+	int start = currentChunk()->count;
 	expression();
 	consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-	emitByte(OP_POP); // Discard the result
+	popExpression(start); // Discard the result
+}
+
+// Whether the code from start is exactly a local compared with another local or a constant
+static bool isLocalComparison(int start)
+{
+	uint8_t* code = currentChunk()->code;
+	return currentChunk()->count == start + 5 && current->lastJumpTarget <= start && code[start] == OP_GET_LOCAL &&
+		(code[start + 2] == OP_GET_LOCAL || code[start + 2] == OP_CONSTANT) && (code[start + 4] == OP_LESS || code[start + 4] == OP_GREATER);
+}
+
+// The jump out of a loop whose condition starts at conditionStart, taken when it's false
+// A condition that's just a local compared with another local or a constant is tested by the jump itself, leaving nothing to pop
+static int emitExitJump(int conditionStart, bool* popCondition)
+{
+	*popCondition = current->wideJumps || !isLocalComparison(conditionStart); // The fused jumps only have two-byte offsets
+	if (*popCondition)
+	{
+		int exitJump = emitJump(OP_JUMP_IF_FALSE);
+		emitByte(OP_POP);
+		return exitJump;
+	}
+
+	Chunk* chunk = currentChunk();
+	uint8_t left = chunk->code[conditionStart + 1];
+	bool rightIsConstant = chunk->code[conditionStart + 2] == OP_CONSTANT;
+	uint8_t right = chunk->code[conditionStart + 3];
+	bool less = chunk->code[conditionStart + 4] == OP_LESS;
+	discardCode(conditionStart, chunk->constants.count);
+
+	if (rightIsConstant)
+		emitByte(less ? OP_JUMP_IF_NOT_LESS_CONST : OP_JUMP_IF_NOT_GREATER_CONST);
+	else
+		emitByte(less ? OP_JUMP_IF_NOT_LESS : OP_JUMP_IF_NOT_GREATER);
+	emitBytes(left, right);
+	emitBytes(0xff, 0xff); // The offset goes last, where patchJump expects it
+	return currentChunk()->count - 2;
 }
 
 static void forStatement()
@@ -947,6 +2293,7 @@ static void forStatement()
 
 	int loopStart = currentChunk()->count;
 	int exitJump = -1;
+	bool popCondition = false;
 
 	if (!match(TOKEN_SEMICOLON))
 	{
@@ -954,8 +2301,7 @@ static void forStatement()
 		consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
 		// Jump when condition is false
-		exitJump = emitJump(OP_JUMP_IF_FALSE);
-		emitByte(OP_POP); // Always pop the condition
+		exitJump = emitExitJump(loopStart, &popCondition);
 	}
 
 	if (!match(TOKEN_RIGHT_PAREN))
@@ -964,7 +2310,7 @@ static void forStatement()
 		int incrementStart = currentChunk()->count; // Jump back to the incrementor
 
 		expression();
-		emitByte(OP_POP); // Pop the expression
+		popExpression(incrementStart);
 		consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
 		emitLoop(loopStart); // Loop after the incrementor
@@ -978,21 +2324,46 @@ static void forStatement()
 	if (exitJump != -1)
 	{
 		patchJump(exitJump);
-		emitByte(OP_POP); // Pop condition
+		if (popCondition)
+			emitByte(OP_POP); // Pop condition
 	}
 
+	current->unreachable = exitJump == -1; // There's no break, so a loop without a condition never exits
 	endScope();
 }
 
 static void ifStatement()
 {
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+	int conditionStart = currentChunk()->count;
 	expression();
 	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+	FoldableConstant condition;
+	if (constantAt(conditionStart, &condition))
+	{
+		// Only one branch can ever run, so there's nothing to test or jump over
+		discardCode(conditionStart, condition.constantCount);
+		if (isFalseyConstant(condition.value))
+		{
+			compileDead(statement);
+			if (match(TOKEN_ELSE))
+				statement();
+		}
+		else
+		{
+			statement();
+			if (match(TOKEN_ELSE))
+				compileDead(statement);
+		}
+		return;
+	}
+
 	int thenJump = emitJump(OP_JUMP_IF_FALSE);
 	emitByte(OP_POP);
 	statement();
+	bool thenReturns = current->unreachable;
+	current->unreachable = false;
 
 	int	elseJump = emitJump(OP_JUMP);
 
@@ -1001,7 +2372,11 @@ static void ifStatement()
 
 	if (match(TOKEN_ELSE))
 		statement();
+	else
+		current->unreachable = false;
 	patchJump(elseJump);
+
+	current->unreachable = thenReturns && current->unreachable;
 }
 
 static void	printStatement()
@@ -1033,6 +2408,8 @@ static void	returnStatement()
 		consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
 		emitByte(OP_RETURN);
 	}
+
+	current->unreachable = true;
 }
 
 static void whileStatement()
@@ -1043,13 +2420,33 @@ static void whileStatement()
 	expression();
 	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-	int exitJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
+	FoldableConstant condition;
+	if (constantAt(loopStart, &condition))
+	{
+		discardCode(loopStart, condition.constantCount);
+		if (isFalseyConstant(condition.value))
+		{
+			compileDead(statement);
+			return;
+		}
+
+		// Always true, so there's no test. There's no break either, so only a return gets out
+		statement();
+		emitLoop(loopStart);
+		current->unreachable = true;
+		return;
+	}
+
+	bool popCondition;
+	int exitJump = emitExitJump(loopStart, &popCondition);
 	statement();
 	emitLoop(loopStart);
 
 	patchJump(exitJump);
-	emitByte(OP_POP); // Always pop the condition value
+	if (popCondition)
+		emitByte(OP_POP); // Pop the condition value
+
+	current->unreachable = false;
 }
 
 static void	synchronize()
@@ -1135,15 +2532,14 @@ static void	statement()
 	}
 }
 
-ObjFunction* compile(const char* source)
+static ObjFunction* script(Compiler* compiler, const char* source, size_t length, bool wideJumps)
 {
-	initScanner(source);
-
-	Compiler compiler;
-	initCompiler(&compiler, TYPE_SCRIPT);
+	initScanner(source, length);
+	initCompiler(compiler, TYPE_SCRIPT, wideJumps, NULL);
 
 	parser.hadError = false;
 	parser.panicMode = false;
+	beginInlining();
 
 	advance();
 
@@ -1153,6 +2549,23 @@ ObjFunction* compile(const char* source)
 	}
 
 	ObjFunction* function = endCompiler();
+	endInlining();
+	return function;
+}
+
+ObjFunction* compile(const char* source, size_t length)
+{
+	Compiler compiler;
+	ObjFunction* function = script(&compiler, source, length, false);
+	if (compiler.jumpTooFar && !parser.hadError)
+	{
+		// Same as for a function: start over with three-byte jumps
+		freeCompiler(&compiler);
+		function = script(&compiler, source, length, true);
+	}
+
+	freeCompiler(&compiler);
+	freeFinished();
 	return parser.hadError ? NULL : function;
 }
 
@@ -1164,4 +2577,9 @@ void markCompilerRoots()
 		markObject((Obj*)compiler->function);
 		compiler = compiler->enclosing;
 	}
+
+	for (int i = 0; i < finishedCount; i++)
+	{
+		markObject((Obj*)finished[i].function);
+	}
 }
\ No newline at end of file
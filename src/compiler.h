@@ -4,7 +4,18 @@
 #include "chunk.h"
 #include "object.h"
 
-ObjFunction* compile(const char* source);
+// Set by -O. Every function then goes through ir.c's passes as well
+extern bool optimizeIR;
+// Set by -l. Function bodies are only checked when declared, and compiled on their first call. Not with -O, which wants every body to inline
+// The source then has to outlive every function compiled from it
+extern bool lazyFunctions;
+
+typedef struct LazyFunction LazyFunction;
+
+ObjFunction* compile(const char* source, size_t length);
+// Swaps the stub of a lazy function for its compiled body. False (and the error reported) if it doesn't compile. function has to be reachable by the GC
+bool compileLazyFunction(ObjFunction* function);
+void freeLazyFunction(ObjFunction* function);
 void markCompilerRoots();
 
 #endif
\ No newline at end of file
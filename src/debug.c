@@ -2,8 +2,13 @@
 
 #include "debug.h"
 #include "object.h"
+#include "optimizer.h"
 #include "value.h"
 
+static int compareJumpInstruction(const char* name, bool constant, Chunk* chunk, int offset);
+static int addLocalInstruction(const char* name, Chunk* chunk, int offset);
+static int wideInstruction(Chunk* chunk, int offset);
+
 void disassembleChunk(Chunk* chunk, const char* name)
 {
 	printf("== %s ==\n", name);
@@ -20,13 +25,14 @@ int disassembleInstruction(Chunk* chunk, int offset)
 	printf("%04d ", offset);
 
 	// Print line #
-	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+	int line = getLine(&chunk->lines, offset);
+	if (offset > 0 && line == getLine(&chunk->lines, offset - 1))
 	{
 		printf("	| ");
 	}
 	else
 	{
-		printf("%4d ", chunk->lines[offset]);
+		printf("%4d ", line);
 	}
 
 	// Print instruction
@@ -35,6 +41,14 @@ int disassembleInstruction(Chunk* chunk, int offset)
 	{
 	case OP_CONSTANT:
 		return constantInstruction("OP_CONSTANT", chunk, offset);
+	case OP_CONSTANT_LONG:
+	{
+		int constant = readLong(chunk->code + offset + 1);
+		printf("%-16s %4d '", "OP_CONSTANT_LONG", constant);
+		printValue(chunk->constants.values[constant]);
+		printf("'\n");
+		return offset + 4;
+	}
 	case OP_NIL:
 		return simpleInstruction("OP_NIL", offset);
 	case OP_TRUE:
@@ -71,6 +85,8 @@ int disassembleInstruction(Chunk* chunk, int offset)
 		return simpleInstruction("OP_LESS", offset);
 	case OP_ADD:
 		return simpleInstruction("OP_ADD", offset);
+	case OP_CONCAT_N:
+		return byteInstruction("OP_CONCAT_N", chunk, offset);
 	case OP_SUBTRACT:
 		return simpleInstruction("OP_SUBTRACT", offset);
 	case OP_MULTIPLY:
@@ -81,20 +97,58 @@ int disassembleInstruction(Chunk* chunk, int offset)
 		return simpleInstruction("OP_NOT", offset);
 	case OP_NEGATE:
 		return simpleInstruction("OP_NEGATE", offset);
+	case OP_GREATER_NN:
+		return simpleInstruction("OP_GREATER_NN", offset);
+	case OP_LESS_NN:
+		return simpleInstruction("OP_LESS_NN", offset);
+	case OP_ADD_NN:
+		return simpleInstruction("OP_ADD_NN", offset);
+	case OP_SUBTRACT_NN:
+		return simpleInstruction("OP_SUBTRACT_NN", offset);
+	case OP_MULTIPLY_NN:
+		return simpleInstruction("OP_MULTIPLY_NN", offset);
+	case OP_DIVIDE_NN:
+		return simpleInstruction("OP_DIVIDE_NN", offset);
+	case OP_ADD_LOCAL:
+		return addLocalInstruction("OP_ADD_LOCAL", chunk, offset);
+	case OP_INC_LOCAL:
+		return addLocalInstruction("OP_INC_LOCAL", chunk, offset);
 	case OP_PRINT:
 		return simpleInstruction("OP_PRINT", offset);
 	case OP_JUMP:
 		return jumpInstruction("OP_JUMP", 1, chunk, offset);
 	case OP_JUMP_IF_FALSE:
 		return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+	case OP_JUMP_IF_TRUE:
+		return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
 	case OP_LOOP:
 		return jumpInstruction("OP_LOOP", -1, chunk, offset);
+	case OP_JUMP_IF_NOT_LESS:
+		return compareJumpInstruction("OP_JUMP_IF_NOT_LESS", false, chunk, offset);
+	case OP_JUMP_IF_NOT_GREATER:
+		return compareJumpInstruction("OP_JUMP_IF_NOT_GREATER", false, chunk, offset);
+	case OP_JUMP_IF_NOT_LESS_CONST:
+		return compareJumpInstruction("OP_JUMP_IF_NOT_LESS_CONST", true, chunk, offset);
+	case OP_JUMP_IF_NOT_GREATER_CONST:
+		return compareJumpInstruction("OP_JUMP_IF_NOT_GREATER_CONST", true, chunk, offset);
 	case OP_CALL:
 		return byteInstruction("OP_CALL", chunk, offset);
 	case OP_INVOKE:
 		return invokeInstruction("OP_INVOKE", chunk, offset);
 	case OP_SUPER_INVOKE:
 		return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+	case OP_INLINE_GUARD:
+	{
+		uint8_t argCount = chunk->code[offset + 1];
+		uint8_t constant = chunk->code[offset + 2];
+		uint16_t jump = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+		printf("%-16s (%d args) %4d ", "OP_INLINE_GUARD", argCount, constant);
+		printValue(chunk->constants.values[constant]);
+		printf(" else call -> %d\n", offset + 5 + jump);
+		return offset + 5;
+	}
+	case OP_INLINE_RETURN:
+		return byteInstruction("OP_INLINE_RETURN", chunk, offset);
 	case OP_CLOSURE:
 	{
 		offset++;
@@ -123,6 +177,10 @@ int disassembleInstruction(Chunk* chunk, int offset)
 		return simpleInstruction("OP_INHERIT", offset);
 	case OP_METHOD:
 		return constantInstruction("OP_METHOD", chunk, offset);
+	case OP_LOAD_FUNCTION:
+		return simpleInstruction("OP_LOAD_FUNCTION", offset);
+	case OP_WIDE:
+		return wideInstruction(chunk, offset);
 	default:
 		printf("Unknown opcod %d\n", instruction);
 		return offset + 1;
@@ -152,6 +210,36 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 	return offset + 3;
 }
 
+// Local slot, then the other local's slot or a constant, then the jump
+static int compareJumpInstruction(const char* name, bool constant, Chunk* chunk, int offset)
+{
+	uint8_t slot = chunk->code[offset + 1];
+	uint8_t right = chunk->code[offset + 2];
+	uint16_t jump = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+
+	printf("%-16s %4d ", name, slot);
+	if (constant)
+	{
+		printf("'");
+		printValue(chunk->constants.values[right]);
+		printf("'");
+	}
+	else
+	{
+		printf("%d", right);
+	}
+	printf(" -> %d\n", offset + 5 + jump);
+	return offset + 5;
+}
+
+static int addLocalInstruction(const char* name, Chunk* chunk, int offset)
+{
+	uint8_t slot = chunk->code[offset + 1];
+	uint8_t amount = chunk->code[offset + 2];
+	printf("%-16s %4d += %d\n", name, slot, amount);
+	return offset + 3;
+}
+
 static int constantInstruction(const char* name, Chunk* chunk, int offset)
 {
 	uint8_t	constant = chunk->code[offset + 1]; // Value is next in bytecode
@@ -163,6 +251,58 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset)
 	return offset + 2;
 }
 
+// Printed like the instruction it widens, after an OP_WIDE
+static int wideInstruction(Chunk* chunk, int offset)
+{
+	uint8_t op = chunk->code[offset + 1];
+	int operand = readLong(chunk->code + offset + 2);
+	int end = offset + instructionLength(chunk, offset);
+	printf("OP_WIDE ");
+
+	switch (op)
+	{
+	case OP_GET_LOCAL: printf("%-16s %4d\n", "OP_GET_LOCAL", operand); break;
+	case OP_SET_LOCAL: printf("%-16s %4d\n", "OP_SET_LOCAL", operand); break;
+	case OP_GET_UPVALUE: printf("%-16s %4d\n", "OP_GET_UPVALUE", operand); break;
+	case OP_SET_UPVALUE: printf("%-16s %4d\n", "OP_SET_UPVALUE", operand); break;
+	case OP_JUMP: printf("%-16s %4d -> %d\n", "OP_JUMP", offset, end + operand); break;
+	case OP_JUMP_IF_FALSE: printf("%-16s %4d -> %d\n", "OP_JUMP_IF_FALSE", offset, end + operand); break;
+	case OP_JUMP_IF_TRUE: printf("%-16s %4d -> %d\n", "OP_JUMP_IF_TRUE", offset, end + operand); break;
+	case OP_LOOP: printf("%-16s %4d -> %d\n", "OP_LOOP", offset, end - operand); break;
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+		printf("%-16s (%d args) %4d '", op == OP_INVOKE ? "OP_INVOKE" : "OP_SUPER_INVOKE", chunk->code[offset + 5], operand);
+		printValue(chunk->constants.values[operand]);
+		printf("\n");
+		break;
+	case OP_CLOSURE:
+	{
+		printf("%-16s %4d ", "OP_CLOSURE", operand);
+		printValue(chunk->constants.values[operand]);
+		printf("\n");
+
+		for (int at = offset + 5; at < end; at += 4)
+		{
+			printf("%04d\t|\t\t\t%s %d\n", at, chunk->code[at] ? "local" : "upvalue", readLong(chunk->code + at + 1));
+		}
+		break;
+	}
+	default:
+	{
+		// Everything else takes a constant
+		const char* name = op == OP_GET_GLOBAL ? "OP_GET_GLOBAL" : op == OP_DEFINE_GLOBAL ? "OP_DEFINE_GLOBAL" :
+			op == OP_SET_GLOBAL ? "OP_SET_GLOBAL" : op == OP_GET_PROPERTY ? "OP_GET_PROPERTY" : op == OP_SET_PROPERTY ? "OP_SET_PROPERTY" :
+			op == OP_GET_SUPER ? "OP_GET_SUPER" : op == OP_CLASS ? "OP_CLASS" : "OP_METHOD";
+		printf("%-16s %4d '", name, operand);
+		printValue(chunk->constants.values[operand]);
+		printf("'\n");
+		break;
+	}
+	}
+
+	return end;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk, int offset)
 {
 	uint8_t	constant = chunk->code[offset + 1];
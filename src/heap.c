@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "heap.h"
+
+#ifdef COMPRESSED_POINTERS
+#ifdef _WIN32
+#include <windows.h>
+#define HEAP_COMMIT_STEP ((size_t)1 << 20) // Commit 1 MB at a time
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+Heap heap;
+
+void initHeap()
+{
+	heap.pages = NULL;
+	for (int i = 0; i < HEAP_CLASS_COUNT; i++)
+	{
+		heap.freeLists[i] = NULL;
+	}
+	heap.sweeping = false;
+
+#ifdef COMPRESSED_POINTERS
+	// Only address space is reserved here. Physical pages are used as the heap grows into it
+#ifdef _WIN32
+	heap.base = (char*)VirtualAlloc(NULL, HEAP_RESERVE, MEM_RESERVE, PAGE_NOACCESS);
+	if (heap.base == NULL)
+	{
+		fprintf(stderr, "Could not reserve the object heap.\n");
+		exit(1);
+	}
+#else
+	void* base = mmap(NULL, HEAP_RESERVE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+	{
+		fprintf(stderr, "Could not reserve the object heap.\n");
+		exit(1);
+	}
+	heap.base = (char*)base;
+#endif
+
+	heap.top = heap.base + HEAP_ALIGNMENT; // Skip offset 0 so it can mean NULL
+	heap.committed = heap.base;
+	heap.end = heap.base + HEAP_RESERVE;
+
+	for (int i = 0; i < HEAP_PAGE_CLASS_COUNT; i++)
+	{
+		heap.freePages[i] = NULL;
+	}
+#endif
+}
+
+#ifdef COMPRESSED_POINTERS
+
+// Page sizes are rounded up to a power of 2 so released pages can be reused by anything of the same class
+static int pageClass(size_t* size)
+{
+	int bits = 0;
+	size_t rounded = 1;
+	while (rounded < *size)
+	{
+		rounded <<= 1;
+		bits++;
+	}
+
+	*size = rounded;
+	return bits;
+}
+
+static HeapPage* allocatePage(size_t size)
+{
+	int pageClassIndex = pageClass(&size);
+
+	HeapPage* page = heap.freePages[pageClassIndex];
+	if (page != NULL)
+	{
+		heap.freePages[pageClassIndex] = page->next;
+		page->size = size;
+		return page;
+	}
+
+	if ((size_t)(heap.end - heap.top) < size)
+	{
+		fprintf(stderr, "Object heap exhausted.\n");
+		exit(1);
+	}
+
+	page = (HeapPage*)heap.top;
+	heap.top += size;
+
+#ifdef _WIN32
+	if (heap.top > heap.committed)
+	{
+		size_t needed = (size_t)(heap.top - heap.committed);
+		size_t commit = (needed + HEAP_COMMIT_STEP - 1) / HEAP_COMMIT_STEP * HEAP_COMMIT_STEP;
+		if ((size_t)(heap.end - heap.committed) < commit)
+			commit = (size_t)(heap.end - heap.committed);
+
+		if (VirtualAlloc(heap.committed, commit, MEM_COMMIT, PAGE_READWRITE) == NULL)
+		{
+			fprintf(stderr, "Object heap exhausted.\n");
+			exit(1);
+		}
+		heap.committed += commit;
+	}
+#endif
+
+	page->size = size;
+	return page;
+}
+
+static void releasePage(HeapPage* page)
+{
+	size_t size = page->size;
+	int pageClassIndex = pageClass(&size);
+	page->next = heap.freePages[pageClassIndex];
+	heap.freePages[pageClassIndex] = page;
+}
+
+#else
+
+static HeapPage* allocatePage(size_t size)
+{
+	HeapPage* page = (HeapPage*)malloc(size);
+	if (page == NULL)
+	{
+		fprintf(stderr, "Object heap exhausted.\n");
+		exit(1);
+	}
+
+	page->size = size;
+	return page;
+}
+
+static void releasePage(HeapPage* page)
+{
+	free(page);
+}
+
+#endif
+
+static HeapPage* newPage(size_t size, uint32_t slotSize, uint32_t slotCount)
+{
+	HeapPage* page = allocatePage(size);
+	page->slotSize = slotSize;
+	page->slotCount = slotCount;
+
+	page->prev = NULL;
+	page->next = heap.pages;
+	if (heap.pages != NULL)
+		heap.pages->prev = page;
+	heap.pages = page;
+
+	return page;
+}
+
+static void unlinkPage(HeapPage* page)
+{
+	if (page->prev != NULL)
+		page->prev->next = page->next;
+	else
+		heap.pages = page->next;
+
+	if (page->next != NULL)
+		page->next->prev = page->prev;
+}
+
+void freeHeap()
+{
+	HeapPage* page = heap.pages;
+	while (page != NULL)
+	{
+		HeapPage* next = page->next;
+		releasePage(page);
+		page = next;
+	}
+	heap.pages = NULL;
+
+#ifdef COMPRESSED_POINTERS
+#ifdef _WIN32
+	VirtualFree(heap.base, 0, MEM_RELEASE);
+#else
+	munmap(heap.base, HEAP_RESERVE);
+#endif
+	heap.base = NULL;
+#endif
+}
+
+static int sizeClass(size_t size)
+{
+	if (size < sizeof(HeapBlock))
+		size = sizeof(HeapBlock); // A freed slot has to hold the free list link
+	return (int)((size + HEAP_ALIGNMENT - 1) >> HEAP_ALIGNMENT_SHIFT);
+}
+
+// Puts every slot of a fresh page on the free list, lowest address first
+static void fillFreeList(int sizeClassIndex)
+{
+	uint32_t slotSize = (uint32_t)sizeClassIndex << HEAP_ALIGNMENT_SHIFT;
+	uint32_t slotCount = (uint32_t)((HEAP_PAGE_SIZE - sizeof(HeapPage)) / slotSize);
+	HeapPage* page = newPage(HEAP_PAGE_SIZE, slotSize, slotCount);
+
+	for (int i = (int)slotCount - 1; i >= 0; i--)
+	{
+		HeapBlock* block = (HeapBlock*)PAGE_SLOT(page, i);
+		block->header = HEAP_FREE_SLOT;
+		block->next = heap.freeLists[sizeClassIndex];
+		heap.freeLists[sizeClassIndex] = block;
+	}
+}
+
+void* heapAllocate(size_t size)
+{
+	if (size > HEAP_SMALL_MAX)
+	{
+		size_t slotSize = (size + HEAP_ALIGNMENT - 1) & ~(size_t)(HEAP_ALIGNMENT - 1);
+		HeapPage* page = newPage(sizeof(HeapPage) + slotSize, (uint32_t)slotSize, 1);
+		return page->slots;
+	}
+
+	int sizeClassIndex = sizeClass(size);
+	if (heap.freeLists[sizeClassIndex] == NULL)
+		fillFreeList(sizeClassIndex);
+
+	HeapBlock* block = heap.freeLists[sizeClassIndex];
+	heap.freeLists[sizeClassIndex] = block->next;
+	return block;
+}
+
+void heapFree(void* pointer, size_t size)
+{
+	if (size > HEAP_SMALL_MAX)
+	{
+		// Large objects are alone in their page, so the whole page goes
+		HeapPage* page = (HeapPage*)((char*)pointer - offsetof(HeapPage, slots));
+		unlinkPage(page);
+		releasePage(page);
+		return;
+	}
+
+	HeapBlock* block = (HeapBlock*)pointer;
+	block->header = HEAP_FREE_SLOT;
+	if (heap.sweeping)
+		return;
+
+	int sizeClassIndex = sizeClass(size);
+	block->next = heap.freeLists[sizeClassIndex];
+	heap.freeLists[sizeClassIndex] = block;
+}
+
+// The GC rebuilds the small free lists page by page, so a page that ends up with nothing live in it can be given back
+void heapBeginSweep()
+{
+	for (int i = 0; i < HEAP_CLASS_COUNT; i++)
+	{
+		heap.freeLists[i] = NULL;
+	}
+	heap.sweeping = true;
+}
+
+// Called for each small-object page once it's swept, with its free slots linked from firstFree to lastFree
+void heapSweptPage(HeapPage* page, HeapBlock* firstFree, HeapBlock* lastFree, bool empty)
+{
+	if (empty)
+	{
+		unlinkPage(page);
+		releasePage(page);
+		return;
+	}
+
+	if (firstFree == NULL)
+		return; // Full
+
+	int sizeClassIndex = (int)(page->slotSize >> HEAP_ALIGNMENT_SHIFT);
+	lastFree->next = heap.freeLists[sizeClassIndex];
+	heap.freeLists[sizeClassIndex] = firstFree;
+}
+
+void heapEndSweep()
+{
+	heap.sweeping = false;
+}
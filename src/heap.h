@@ -0,0 +1,111 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+
+// Every object lives in a heap page. Small objects share pages of a single size class, bigger ones get a page to themselves
+// The GC sweeps by walking the pages, so objects don't have to be linked together
+#define HEAP_ALIGNMENT_SHIFT 3
+#define HEAP_ALIGNMENT (1 << HEAP_ALIGNMENT_SHIFT)
+#define HEAP_PAGE_SIZE ((size_t)1 << 16)
+#define HEAP_SMALL_MAX 512
+#define HEAP_CLASS_COUNT (HEAP_SMALL_MAX / HEAP_ALIGNMENT + 1)
+
+// First word of a free slot. An object header never has all of its type bits set, so this can't be mistaken for one
+#define HEAP_FREE_SLOT UINT64_MAX
+
+typedef struct HeapBlock
+{
+	uint64_t header; // HEAP_FREE_SLOT
+	struct HeapBlock* next;
+} HeapBlock;
+
+typedef struct HeapPage
+{
+	struct HeapPage* next;
+	struct HeapPage* prev;
+	size_t size; // Including this header
+	uint32_t slotSize;
+	uint32_t slotCount;
+	char slots[];
+} HeapPage;
+
+#define PAGE_SLOT(page, index) ((void*)((page)->slots + (size_t)(index) * (page)->slotSize))
+
+#ifdef COMPRESSED_POINTERS
+
+#if UINTPTR_MAX == UINT32_MAX
+#error "COMPRESSED_POINTERS only makes sense for 64-bit builds"
+#endif
+
+#define HEAP_RESERVE ((size_t)UINT32_MAX << HEAP_ALIGNMENT_SHIFT) // Everything a 32-bit ref can reach (32 GB of address space)
+#define HEAP_PAGE_CLASS_COUNT 64
+
+#endif
+
+typedef struct
+{
+	HeapPage* pages;
+	HeapBlock* freeLists[HEAP_CLASS_COUNT];
+	bool sweeping; // Freed small slots are put back on the free lists by heapSweptPage() instead
+#ifdef COMPRESSED_POINTERS
+	// Pages are carved out of one reserved region, so a 32-bit offset can reach every object
+	char* base;
+	char* top; // Everything below has been handed out at some point
+	char* committed; // Only grows on Windows, where reserved memory has to be committed before use
+	char* end;
+	HeapPage* freePages[HEAP_PAGE_CLASS_COUNT]; // Released pages, by power of 2, since the region can't be handed back
+#endif
+} Heap;
+
+extern Heap heap;
+
+void initHeap();
+void freeHeap();
+void* heapAllocate(size_t size);
+void heapFree(void* pointer, size_t size);
+void heapBeginSweep();
+void heapSweptPage(HeapPage* page, HeapBlock* firstFree, HeapBlock* lastFree, bool empty);
+void heapEndSweep();
+
+static inline bool isFreeSlot(const void* slot)
+{
+	return *(const uint64_t*)slot == HEAP_FREE_SLOT;
+}
+
+// REF(type) is how objects and tables store a reference to another object
+// Normally that's just a pointer. With COMPRESSED_POINTERS it's a 32-bit offset from the heap's base, in units of HEAP_ALIGNMENT
+#ifdef COMPRESSED_POINTERS
+
+typedef uint32_t ObjRef;
+
+// Offset 0 is never handed out, so it doubles as NULL
+static inline ObjRef heapRef(const void* pointer)
+{
+	if (pointer == NULL)
+		return 0;
+	return (ObjRef)(((const char*)pointer - heap.base) >> HEAP_ALIGNMENT_SHIFT);
+}
+
+static inline void* heapPointer(ObjRef ref)
+{
+	if (ref == 0)
+		return NULL;
+	return heap.base + ((size_t)ref << HEAP_ALIGNMENT_SHIFT);
+}
+
+#define REF(type) ObjRef
+#define NULL_REF 0
+#define TO_REF(pointer) heapRef(pointer)
+#define FROM_REF(type, ref) ((type*)heapPointer(ref))
+
+#else
+
+#define REF(type) type*
+#define NULL_REF NULL
+#define TO_REF(pointer) (pointer)
+#define FROM_REF(type, ref) (ref)
+
+#endif
+
+#endif
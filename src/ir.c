@@ -0,0 +1,1351 @@
+#include <string.h>
+
+#include "ir.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "table.h"
+
+#define IR_MAX_TEMPS 16 // Slots reserved for hoisted values, per function
+#define IR_MAX_INLINE 32 // Bytes of code a function can have and still be copied into its callers
+
+typedef struct
+{
+	int offset; // Where it is in the chunk the compiler produced
+	int length;
+	uint8_t op;
+	int target; // Index of the instruction a jump lands on (the instruction count for the end of the chunk)
+	int height; // Stack slots in use before it runs, slot 0 included. -1 if nothing reaches it
+	bool leader; // Starts a basic block
+	bool removed;
+	bool rewritten; // Now just loads slot
+	int slot;
+	bool temp; // slot is a hoisting temporary rather than a slot from the original numbering
+	ObjFunction* inlined; // For a call, the function whose body goes in its place
+} IrInstruction;
+
+// Code moved out of a loop. It's a copy of start..end, stored in its temporary and run before the loop's header
+typedef struct
+{
+	int header;
+	int start;
+	int end;
+} Hoist;
+
+typedef struct
+{
+	ObjFunction* function;
+	Chunk* chunk;
+	IrInstruction* instructions;
+	int count;
+	int maxHeight;
+	int firstLocal; // Slot 0 and the parameters come first, then locals. Temporaries go in between
+	bool captured[UINT8_COUNT]; // Slots a closure captures somewhere in the function
+	int* canonical; // For each constant, the first constant equal to it. Globals are named by a constant each time they're used
+	int constantCount; // When canonical was made. Inlining can add constants
+	Hoist hoists[IR_MAX_TEMPS];
+	int hoistCount;
+	bool changed;
+} IrFunction;
+
+static bool isCompareJump(uint8_t op)
+{
+	return op == OP_JUMP_IF_NOT_LESS || op == OP_JUMP_IF_NOT_GREATER || op == OP_JUMP_IF_NOT_LESS_CONST || op == OP_JUMP_IF_NOT_GREATER_CONST;
+}
+
+static bool isJump(uint8_t op)
+{
+	return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE || op == OP_LOOP || isCompareJump(op);
+}
+
+static uint8_t operand(IrFunction* ir, int index)
+{
+	return ir->chunk->code[ir->instructions[index].offset + 1];
+}
+
+static void stackEffect(IrFunction* ir, int index, int* pops, int* pushes)
+{
+	*pops = 0;
+	*pushes = 0;
+
+	switch (ir->instructions[index].op)
+	{
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_CLOSURE:
+	case OP_CLASS:
+		*pushes = 1;
+		break;
+	case OP_POP:
+	case OP_DEFINE_GLOBAL:
+	case OP_PRINT:
+	case OP_CLOSE_UPVALUE:
+	case OP_INHERIT:
+	case OP_METHOD:
+	case OP_RETURN:
+		*pops = 1;
+		break;
+	case OP_SET_LOCAL:
+	case OP_SET_GLOBAL:
+	case OP_SET_UPVALUE:
+	case OP_GET_PROPERTY:
+	case OP_NOT:
+	case OP_NEGATE:
+		*pops = 1;
+		*pushes = 1;
+		break;
+	case OP_SET_PROPERTY:
+	case OP_GET_SUPER:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_GREATER_NN:
+	case OP_LESS_NN:
+	case OP_ADD_NN:
+	case OP_SUBTRACT_NN:
+	case OP_MULTIPLY_NN:
+	case OP_DIVIDE_NN:
+		*pops = 2;
+		*pushes = 1;
+		break;
+	case OP_CONCAT_N:
+		*pops = operand(ir, index);
+		*pushes = 1;
+		break;
+	case OP_CALL:
+		*pops = operand(ir, index) + 1; // Arguments and the callee
+		*pushes = 1;
+		break;
+	case OP_INVOKE:
+		*pops = ir->chunk->code[ir->instructions[index].offset + 2] + 1; // Arguments and the receiver
+		*pushes = 1;
+		break;
+	case OP_SUPER_INVOKE:
+		*pops = ir->chunk->code[ir->instructions[index].offset + 2] + 2; // The superclass too
+		*pushes = 1;
+		break;
+	default:
+		break; // Jumps and adding to a local leave the stack alone
+	}
+}
+
+static bool isCall(uint8_t op)
+{
+	return op == OP_CALL || op == OP_INVOKE || op == OP_SUPER_INVOKE;
+}
+
+// Leaves that only read something
+static bool isLoad(uint8_t op)
+{
+	return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE ||
+		op == OP_GET_LOCAL || op == OP_GET_UPVALUE || op == OP_GET_GLOBAL;
+}
+
+// Operators the type inference picked, which skip the type checks
+static bool isNumberOp(uint8_t op)
+{
+	return op == OP_GREATER_NN || op == OP_LESS_NN || op == OP_ADD_NN ||
+		op == OP_SUBTRACT_NN || op == OP_MULTIPLY_NN || op == OP_DIVIDE_NN;
+}
+
+// Operators whose result only depends on their operands
+static bool isPureOp(uint8_t op)
+{
+	if (isNumberOp(op))
+		return true;
+
+	switch (op)
+	{
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_NOT:
+	case OP_NEGATE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int operandCount(uint8_t op)
+{
+	return op == OP_NOT || op == OP_NEGATE ? 1 : 2;
+}
+
+// Whether op can end the script with a runtime error. Type errors, or an undefined global
+static bool canFail(uint8_t op)
+{
+	return op == OP_GET_GLOBAL || (isPureOp(op) && op != OP_EQUAL && op != OP_NOT && !isNumberOp(op));
+}
+
+static bool reach(IrFunction* ir, int index, int height)
+{
+	if (index >= ir->count || ir->instructions[index].height >= 0)
+		return false;
+
+	ir->instructions[index].height = height;
+	return true;
+}
+
+static void buildIr(IrFunction* ir, ObjFunction* function)
+{
+	Chunk* chunk = &function->chunk;
+	ir->function = function;
+	ir->chunk = chunk;
+	ir->firstLocal = function->arity + 1;
+	ir->hoistCount = 0;
+	ir->changed = false;
+
+	ir->count = 0;
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+	{
+		ir->count++;
+	}
+
+	ir->instructions = ALLOCATE(IrInstruction, ir->count);
+	int* indexAt = ALLOCATE(int, chunk->count + 1);
+	indexAt[chunk->count] = ir->count;
+
+	int offset = 0;
+	for (int i = 0; i < ir->count; i++)
+	{
+		IrInstruction* instruction = &ir->instructions[i];
+		instruction->offset = offset;
+		instruction->length = instructionLength(chunk, offset);
+		instruction->op = chunk->code[offset];
+		instruction->height = -1;
+		instruction->leader = i == 0;
+		instruction->removed = false;
+		instruction->rewritten = false;
+		instruction->temp = false;
+		instruction->inlined = NULL;
+		indexAt[offset] = i;
+		offset += instruction->length;
+	}
+
+	// Blocks start at jump targets and after anything that jumps or returns
+	for (int i = 0; i < ir->count; i++)
+	{
+		IrInstruction* instruction = &ir->instructions[i];
+		if (isJump(instruction->op))
+		{
+			int end = instruction->offset + instruction->length;
+			uint16_t jump = (uint16_t)((chunk->code[end - 2] << 8) | chunk->code[end - 1]);
+			int target = instruction->op == OP_LOOP ? end - jump : end + jump;
+			instruction->target = indexAt[target];
+			if (instruction->target < ir->count)
+				ir->instructions[instruction->target].leader = true;
+		}
+
+		if ((isJump(instruction->op) || instruction->op == OP_RETURN) && i + 1 < ir->count)
+			ir->instructions[i + 1].leader = true;
+	}
+	FREE_ARRAY(int, indexAt, chunk->count + 1);
+
+	// The compiler keeps the stack the same height wherever paths meet, so the first height seen is the height
+	ir->instructions[0].height = ir->firstLocal;
+	ir->maxHeight = ir->firstLocal;
+	bool changed;
+	do
+	{
+		changed = false;
+		for (int i = 0; i < ir->count; i++)
+		{
+			IrInstruction* instruction = &ir->instructions[i];
+			if (instruction->height < 0)
+				continue;
+
+			int pops, pushes;
+			stackEffect(ir, i, &pops, &pushes);
+			int after = instruction->height - pops + pushes;
+			if (after > ir->maxHeight)
+				ir->maxHeight = after;
+
+			if (isJump(instruction->op))
+				changed |= reach(ir, instruction->target, after);
+			if (instruction->op != OP_JUMP && instruction->op != OP_LOOP && instruction->op != OP_RETURN)
+				changed |= reach(ir, i + 1, after);
+		}
+	}
+	while (changed);
+
+	memset(ir->captured, 0, sizeof(ir->captured));
+	for (int i = 0; i < ir->count; i++)
+	{
+		IrInstruction* instruction = &ir->instructions[i];
+		if (instruction->op != OP_CLOSURE)
+			continue;
+
+		for (int j = 2; j < instruction->length; j += 2)
+		{
+			if (chunk->code[instruction->offset + j])
+				ir->captured[chunk->code[instruction->offset + j + 1]] = true;
+		}
+	}
+
+	Value* constants = chunk->constants.values;
+	ir->constantCount = chunk->constants.count;
+	ir->canonical = ALLOCATE(int, ir->constantCount + 1);
+	for (int i = 0; i < ir->constantCount; i++)
+	{
+		ir->canonical[i] = i;
+		for (int j = 0; j < i; j++)
+		{
+			if (valuesEqual(constants[j], constants[i]))
+			{
+				ir->canonical[i] = j;
+				break;
+			}
+		}
+	}
+}
+
+static void freeIr(IrFunction* ir)
+{
+	FREE_ARRAY(IrInstruction, ir->instructions, ir->count);
+	FREE_ARRAY(int, ir->canonical, ir->constantCount + 1);
+}
+
+// Type inference. Each stack slot is either certainly a number or could be anything, and where paths meet a slot
+// is only a number if it is on all of them. Arithmetic on two numbers then skips the checks. Parameters could be
+// anything, but locals a function starts at a number and only does arithmetic on, like counters, are found
+
+// Runs the instruction over the slots before it, leaving what's in them after it
+static void typeStep(IrFunction* ir, int index, bool* numbers)
+{
+	IrInstruction* instruction = &ir->instructions[index];
+	int height = instruction->height;
+	int pops, pushes;
+	stackEffect(ir, index, &pops, &pushes);
+
+	switch (instruction->op)
+	{
+	case OP_CONSTANT:
+		numbers[height] = IS_NUMBER(ir->chunk->constants.values[operand(ir, index)]);
+		break;
+	case OP_GET_LOCAL:
+		// A closure can store anything in a captured local
+		numbers[height] = numbers[operand(ir, index)] && !ir->captured[operand(ir, index)];
+		break;
+	case OP_SET_LOCAL:
+		numbers[operand(ir, index)] = numbers[height - 1];
+		break;
+	case OP_ADD:
+		numbers[height - 2] = numbers[height - 2] && numbers[height - 1]; // Or a string
+		break;
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_NEGATE:
+		numbers[height - pops] = true; // Or a runtime error, and then nothing after it runs
+		break;
+	case OP_ADD_LOCAL:
+		numbers[operand(ir, index)] = true;
+		break;
+	default:
+		if (pushes == 1)
+			numbers[height - pops] = false;
+		break;
+	}
+}
+
+static bool mergeTypes(IrFunction* ir, bool* types, bool* seen, int index, bool* numbers)
+{
+	if (index >= ir->count)
+		return false;
+
+	bool* into = types + index * (ir->maxHeight + 1);
+	if (!seen[index])
+	{
+		seen[index] = true;
+		memcpy(into, numbers, sizeof(bool) * ir->instructions[index].height);
+		return true;
+	}
+
+	bool changed = false;
+	for (int slot = 0; slot < ir->instructions[index].height; slot++)
+	{
+		if (into[slot] && !numbers[slot])
+		{
+			into[slot] = false;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+static uint8_t numberOp(uint8_t op)
+{
+	switch (op)
+	{
+	case OP_GREATER: return OP_GREATER_NN;
+	case OP_LESS: return OP_LESS_NN;
+	case OP_ADD: return OP_ADD_NN;
+	case OP_SUBTRACT: return OP_SUBTRACT_NN;
+	case OP_MULTIPLY: return OP_MULTIPLY_NN;
+	case OP_DIVIDE: return OP_DIVIDE_NN;
+	default: return op;
+	}
+}
+
+static void inferTypes(IrFunction* ir)
+{
+	int width = ir->maxHeight + 1;
+	bool* types = ALLOCATE(bool, ir->count * width); // What's in each slot before each instruction
+	bool* seen = ALLOCATE(bool, ir->count);
+	bool* numbers = ALLOCATE(bool, width);
+	memset(seen, 0, sizeof(bool) * ir->count);
+
+	// Slot 0 and the parameters could be anything
+	memset(numbers, 0, sizeof(bool) * width);
+	mergeTypes(ir, types, seen, 0, numbers);
+
+	bool changed;
+	do
+	{
+		changed = false;
+		for (int i = 0; i < ir->count; i++)
+		{
+			IrInstruction* instruction = &ir->instructions[i];
+			if (!seen[i])
+				continue;
+
+			memcpy(numbers, types + i * width, sizeof(bool) * instruction->height);
+			typeStep(ir, i, numbers);
+
+			if (isJump(instruction->op))
+				changed |= mergeTypes(ir, types, seen, instruction->target, numbers);
+			if (instruction->op != OP_JUMP && instruction->op != OP_LOOP && instruction->op != OP_RETURN)
+				changed |= mergeTypes(ir, types, seen, i + 1, numbers);
+		}
+	}
+	while (changed);
+
+	for (int i = 0; i < ir->count; i++)
+	{
+		IrInstruction* instruction = &ir->instructions[i];
+		bool* before = types + i * width;
+		int height = instruction->height;
+		if (!seen[i])
+			continue;
+
+		if (instruction->op == OP_ADD_LOCAL && before[operand(ir, i)] && !ir->captured[operand(ir, i)])
+		{
+			instruction->op = OP_INC_LOCAL;
+			ir->changed = true;
+		}
+		else if (numberOp(instruction->op) != instruction->op && before[height - 1] && before[height - 2])
+		{
+			instruction->op = numberOp(instruction->op);
+			ir->changed = true;
+		}
+	}
+
+	FREE_ARRAY(bool, types, ir->count * width);
+	FREE_ARRAY(bool, seen, ir->count);
+	FREE_ARRAY(bool, numbers, width);
+}
+
+// Loop-invariant code motion
+
+typedef struct
+{
+	int header; // Where the back edges land. The condition, for while and for loops
+	int headerEnd; // First instruction after the header's block
+	int end; // Last instruction in the loop
+	bool hasCall; // A call can change any global or upvalue
+	bool storedLocal[UINT8_COUNT];
+	bool storedUpvalue[UINT8_COUNT];
+} Loop;
+
+// A value on the abstract stack while looking for invariant expressions. Its code is start..end, since the bytecode is postfix
+typedef struct
+{
+	int start;
+	int end;
+	bool invariant;
+	bool canFail;
+} IrValue;
+
+static bool storesGlobal(IrFunction* ir, Loop* loop, int name)
+{
+	for (int i = loop->header; i <= loop->end; i++)
+	{
+		uint8_t op = ir->instructions[i].op;
+		if ((op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL) && ir->canonical[operand(ir, i)] == ir->canonical[name])
+			return true;
+	}
+
+	return false;
+}
+
+static bool isInvariantLoad(IrFunction* ir, Loop* loop, int index)
+{
+	IrInstruction* instruction = &ir->instructions[index];
+	if (instruction->rewritten)
+		return false;
+
+	int slot = operand(ir, index);
+	switch (instruction->op)
+	{
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+		return true;
+	case OP_GET_LOCAL:
+		// Locals declared inside the loop reuse slots above the header's height
+		return slot < ir->instructions[loop->header].height && !loop->storedLocal[slot] && !ir->captured[slot];
+	case OP_GET_UPVALUE:
+		return !loop->hasCall && !loop->storedUpvalue[slot];
+	case OP_GET_GLOBAL:
+		return !loop->hasCall && !storesGlobal(ir, loop, slot);
+	default:
+		return false;
+	}
+}
+
+// Nothing observable happens when these run, so hoisted code can go ahead of them
+static bool isUnobservable(IrInstruction* instruction)
+{
+	if (instruction->rewritten)
+		return true;
+
+	uint8_t op = instruction->op;
+	return (isLoad(op) || isPureOp(op)) && !canFail(op);
+}
+
+static bool worthHoisting(IrFunction* ir, IrValue* value)
+{
+	uint8_t op = ir->instructions[value->start].op;
+	return value->end > value->start || op == OP_GET_GLOBAL || op == OP_GET_UPVALUE;
+}
+
+static void addCandidate(IrFunction* ir, IrValue* value, IrValue* candidates, int* count)
+{
+	if (!value->invariant || !worthHoisting(ir, value))
+		return;
+
+	// Kept in order of where they start
+	int i = *count;
+	while (i > 0 && candidates[i - 1].start > value->start)
+	{
+		candidates[i] = candidates[i - 1];
+		i--;
+	}
+	candidates[i] = *value;
+	(*count)++;
+}
+
+static void hoist(IrFunction* ir, Loop* loop, IrValue* value)
+{
+	int temp = ir->hoistCount++;
+	Hoist* hoisted = &ir->hoists[temp];
+	hoisted->header = loop->header;
+	hoisted->start = value->start;
+	hoisted->end = value->end;
+
+	IrInstruction* first = &ir->instructions[value->start];
+	first->rewritten = true;
+	first->temp = true;
+	first->slot = temp;
+	for (int i = value->start + 1; i <= value->end; i++)
+	{
+		ir->instructions[i].removed = true;
+	}
+
+	ir->changed = true;
+}
+
+static void hoistInvariants(IrFunction* ir, Loop* loop)
+{
+	memset(loop->storedLocal, 0, sizeof(loop->storedLocal));
+	memset(loop->storedUpvalue, 0, sizeof(loop->storedUpvalue));
+	loop->hasCall = false;
+	for (int i = loop->header; i <= loop->end; i++)
+	{
+		uint8_t op = ir->instructions[i].op;
+		if (op == OP_SET_LOCAL || op == OP_ADD_LOCAL || op == OP_INC_LOCAL)
+			loop->storedLocal[operand(ir, i)] = true;
+		else if (op == OP_SET_UPVALUE)
+			loop->storedUpvalue[operand(ir, i)] = true;
+		else if (isCall(op))
+			loop->hasCall = true;
+	}
+
+	loop->headerEnd = loop->header + 1;
+	while (loop->headerEnd <= loop->end && !ir->instructions[loop->headerEnd].leader)
+		loop->headerEnd++;
+
+	// Find the largest invariant expressions, block by block
+	IrValue* stack = ALLOCATE(IrValue, ir->maxHeight + 1);
+	IrValue* candidates = ALLOCATE(IrValue, loop->end - loop->header + 1);
+	int depth = 0;
+	int candidateCount = 0;
+
+	for (int i = loop->header; i <= loop->end + 1; i++)
+	{
+		if (i > loop->end || ir->instructions[i].leader)
+		{
+			while (depth > 0)
+				addCandidate(ir, &stack[--depth], candidates, &candidateCount);
+			if (i > loop->end)
+				break;
+		}
+
+		IrInstruction* instruction = &ir->instructions[i];
+		if (instruction->removed || instruction->height < 0)
+			continue;
+
+		if (instruction->rewritten || isLoad(instruction->op))
+		{
+			IrValue value = { i, i, isInvariantLoad(ir, loop, i), canFail(instruction->op) };
+			stack[depth++] = value;
+			continue;
+		}
+
+		int pops, pushes;
+		stackEffect(ir, i, &pops, &pushes);
+
+		IrValue result = { i, i, isPureOp(instruction->op), canFail(instruction->op) };
+		if (depth < pops)
+			result.invariant = false; // Uses something from before the block
+		for (int j = depth - 1; j >= 0 && j >= depth - pops; j--)
+		{
+			result.start = stack[j].start;
+			result.invariant &= stack[j].invariant;
+			result.canFail |= stack[j].canFail;
+		}
+
+		for (int j = 0; j < pops && depth > 0; j++)
+		{
+			depth--;
+			if (!result.invariant)
+				addCandidate(ir, &stack[depth], candidates, &candidateCount);
+		}
+
+		if (pushes == 1)
+			stack[depth++] = result;
+	}
+
+	// The header runs every time the loop does, so it's the only place something that can fail can be taken from
+	// Even then everything the header did before has to be unobservable, since the hoisted code now runs first
+	int scanned = loop->header;
+	bool unobservable = true;
+	for (int i = 0; i < candidateCount && ir->hoistCount < IR_MAX_TEMPS; i++)
+	{
+		IrValue* candidate = &candidates[i];
+		bool inHeader = candidate->start < loop->headerEnd;
+		if (inHeader)
+		{
+			for (; scanned < candidate->start; scanned++)
+			{
+				IrInstruction* instruction = &ir->instructions[scanned];
+				if (!instruction->removed && !isUnobservable(instruction))
+					unobservable = false;
+			}
+		}
+
+		if (!candidate->canFail || (inHeader && unobservable))
+		{
+			hoist(ir, loop, candidate);
+			if (inHeader)
+				scanned = candidate->end + 1;
+		}
+	}
+
+	FREE_ARRAY(IrValue, stack, ir->maxHeight + 1);
+	FREE_ARRAY(IrValue, candidates, loop->end - loop->header + 1);
+}
+
+// Hoisted code goes right before the header, so the loop has to be entered by falling into its header, and only there
+// A for's increment looks like a loop of its own, but the body's back edge is the only way in, so it has no such place
+static bool hasPreheader(IrFunction* ir, Loop* loop)
+{
+	int before = loop->header - 1;
+	while (before >= 0 && ir->instructions[before].removed)
+		before--;
+
+	if (before < 0 || ir->instructions[before].height < 0)
+		return false;
+
+	uint8_t op = ir->instructions[before].op;
+	if (op == OP_JUMP || op == OP_LOOP || op == OP_RETURN)
+		return false;
+
+	for (int i = 0; i < ir->count; i++)
+	{
+		IrInstruction* instruction = &ir->instructions[i];
+		if (instruction->removed || !isJump(instruction->op) || (i >= loop->header && i <= loop->end))
+			continue;
+
+		if (instruction->target > loop->header && instruction->target <= loop->end)
+			return false;
+	}
+
+	return true;
+}
+
+static void hoistLoops(IrFunction* ir)
+{
+	// Outer loops first, so an expression moves as far out as it can
+	for (int header = 0; header < ir->count; header++)
+	{
+		if (!ir->instructions[header].leader || ir->instructions[header].height < 0)
+			continue;
+
+		Loop loop;
+		loop.header = header;
+		loop.end = -1;
+		for (int i = header; i < ir->count; i++)
+		{
+			// Other back edges into the loop make it longer, like the body's jump back to the increment in a for
+			if (ir->instructions[i].op == OP_LOOP && ir->instructions[i].target >= header &&
+				(loop.end == -1 ? ir->instructions[i].target == header : ir->instructions[i].target <= loop.end))
+			{
+				loop.end = i;
+			}
+		}
+
+		if (loop.end != -1 && hasPreheader(ir, &loop))
+			hoistInvariants(ir, &loop);
+	}
+}
+
+// Inlining. A call to a small top-level function that only computes a value from its arguments can run the callee's
+// body right where the callee and arguments already are on the stack. The body's slots are just shifted up to them
+// OP_INLINE_GUARD checks the name is still bound to that function at run time, and makes a real call if it isn't
+
+static Table globalFunctions;
+
+static bool isInlineable(ObjFunction* function)
+{
+	Chunk* chunk = &function->chunk;
+	if (function->upvalueCount > 0 || chunk->count > IR_MAX_INLINE)
+		return false;
+
+	// OP_INLINE_RETURN only drops the callee and its arguments, so a local declared in the body would be left behind
+	if (function->localCount > function->arity + 1)
+		return false;
+
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+	{
+		uint8_t op = chunk->code[offset];
+		if (op == OP_RETURN)
+			return offset == chunk->count - 1; // Only as the very last instruction
+
+		if (!isLoad(op) && !isPureOp(op) && op != OP_CONCAT_N && op != OP_GET_PROPERTY)
+			return false;
+	}
+
+	return false;
+}
+
+void beginInlining()
+{
+	initTable(&globalFunctions);
+}
+
+void endInlining()
+{
+	freeTable(&globalFunctions);
+}
+
+void noteGlobalFunction(ObjString* name, ObjFunction* function)
+{
+	if (isInlineable(function))
+		tableSet(&globalFunctions, name, OBJ_VAL(function));
+	else
+		tableDelete(&globalFunctions, name); // Calls compiled from here on reach the new one
+}
+
+static void inlineCall(IrFunction* ir, int index, int callee)
+{
+	if (callee < 0 || ir->instructions[callee].op != OP_GET_GLOBAL || ir->instructions[callee].rewritten)
+		return;
+
+	Value function;
+	if (!tableGet(&globalFunctions, AS_STRING(ir->chunk->constants.values[operand(ir, callee)]), &function) ||
+		AS_FUNCTION(function)->arity != operand(ir, index))
+		return;
+
+	ir->instructions[index].inlined = AS_FUNCTION(function);
+	ir->changed = true;
+}
+
+static void findInlineCalls(IrFunction* ir)
+{
+	int* producers = ALLOCATE(int, ir->maxHeight + 1); // The instruction that pushed what's in each slot, within the block
+
+	for (int i = 0; i < ir->count; i++)
+	{
+		IrInstruction* instruction = &ir->instructions[i];
+		if (instruction->removed || instruction->height < 0)
+			continue;
+
+		int height = instruction->height;
+		if (instruction->leader)
+		{
+			for (int slot = 0; slot < height; slot++)
+			{
+				producers[slot] = -1;
+			}
+		}
+
+		if (instruction->rewritten)
+		{
+			producers[height] = -1;
+			continue;
+		}
+
+		int pops, pushes;
+		stackEffect(ir, i, &pops, &pushes);
+		if (instruction->op == OP_CALL)
+			inlineCall(ir, i, producers[height - pops]);
+
+		if (pushes == 1)
+			producers[height - pops] = i;
+	}
+
+	FREE_ARRAY(int, producers, ir->maxHeight + 1);
+}
+
+// Local value numbering. Two values get the same number when they're certainly equal, so a value that's already
+// sitting in a stack slot (a local, or an operand waiting further down) can be read from there instead of recomputed
+// Locals that copy each other share a number too, which is the copy propagation
+
+typedef struct
+{
+	int op;
+	int operand;
+	int left;
+	int right;
+	int number; // -1 for an empty entry
+} ValueKey;
+
+typedef struct
+{
+	ValueKey* keys;
+	int capacity;
+	int* holders; // For each number, a slot that has held it
+	int holderCapacity;
+	int count;
+	// The abstract stack
+	int* numbers;
+	int* starts; // Where the code computing each value starts
+	bool* pure; // Whether that code is nothing but loads and pure operators
+	int globalEpoch; // Bumped whenever a global might have changed
+	int upvalueEpoch;
+} Numbering;
+
+static int newNumber(Numbering* numbering)
+{
+	if (numbering->count == numbering->holderCapacity)
+	{
+		int oldCapacity = numbering->holderCapacity;
+		numbering->holderCapacity = GROW_CAPACITY(oldCapacity);
+		numbering->holders = GROW_ARRAY(int, numbering->holders, oldCapacity, numbering->holderCapacity);
+	}
+
+	numbering->holders[numbering->count] = -1;
+	return numbering->count++;
+}
+
+static int lookupNumber(Numbering* numbering, int op, int operand, int left, int right)
+{
+	uint32_t hash = (uint32_t)op;
+	hash = hash * 31 + (uint32_t)operand;
+	hash = hash * 31 + (uint32_t)left;
+	hash = hash * 31 + (uint32_t)right;
+
+	uint32_t index = hash & (numbering->capacity - 1);
+	for (;;)
+	{
+		ValueKey* key = &numbering->keys[index];
+		if (key->number == -1)
+		{
+			key->op = op;
+			key->operand = operand;
+			key->left = left;
+			key->right = right;
+			key->number = newNumber(numbering);
+			return key->number;
+		}
+
+		if (key->op == op && key->operand == operand && key->left == left && key->right == right)
+			return key->number;
+
+		index = (index + 1) & (numbering->capacity - 1);
+	}
+}
+
+static bool isHeld(Numbering* numbering, int number, int height)
+{
+	int slot = numbering->holders[number];
+	return slot >= 0 && slot < height && numbering->numbers[slot] == number;
+}
+
+// Lower slots are kept as holders since they outlive the ones above them
+static void assign(Numbering* numbering, int slot, int number, int height)
+{
+	numbering->numbers[slot] = number;
+	if (!isHeld(numbering, number, height) || slot < numbering->holders[number])
+		numbering->holders[number] = slot;
+}
+
+static void pushValue(Numbering* numbering, int slot, int number, int start, bool pure)
+{
+	assign(numbering, slot, number, slot + 1);
+	numbering->starts[slot] = start;
+	numbering->pure[slot] = pure;
+}
+
+static int renumber(IrFunction* ir, int slot)
+{
+	return slot >= ir->firstLocal ? slot + ir->hoistCount : slot;
+}
+
+// The value index just left in slot was computed before and is still further down the stack
+static void reuseValue(IrFunction* ir, Numbering* numbering, int index, int slot)
+{
+	int number = numbering->numbers[slot];
+	if (!numbering->pure[slot] || !isHeld(numbering, number, slot))
+		return;
+
+	int holder = numbering->holders[number];
+	if (renumber(ir, holder) > UINT8_MAX)
+		return;
+
+	// Only worth it when it replaces more than one instruction, or a lookup
+	int start = numbering->starts[slot];
+	int live = 0;
+	for (int i = start; i <= index; i++)
+	{
+		if (!ir->instructions[i].removed)
+			live++;
+	}
+
+	uint8_t op = ir->instructions[index].op;
+	if (live < 2 && op != OP_GET_GLOBAL && op != OP_GET_UPVALUE)
+		return;
+
+	for (int i = start; i < index; i++)
+	{
+		ir->instructions[i].removed = true;
+	}
+
+	IrInstruction* instruction = &ir->instructions[index];
+	instruction->rewritten = true;
+	instruction->temp = false;
+	instruction->slot = holder;
+	ir->changed = true;
+}
+
+static void numberValues(IrFunction* ir)
+{
+	Numbering numbering;
+	numbering.capacity = 8;
+	while (numbering.capacity < ir->count * 2)
+		numbering.capacity *= 2;
+	numbering.keys = ALLOCATE(ValueKey, numbering.capacity);
+	for (int i = 0; i < numbering.capacity; i++)
+	{
+		numbering.keys[i].number = -1;
+	}
+
+	numbering.holders = NULL;
+	numbering.holderCapacity = 0;
+	numbering.count = 0;
+	numbering.numbers = ALLOCATE(int, ir->maxHeight + 1);
+	numbering.starts = ALLOCATE(int, ir->maxHeight + 1);
+	numbering.pure = ALLOCATE(bool, ir->maxHeight + 1);
+	numbering.globalEpoch = 0;
+	numbering.upvalueEpoch = 0;
+
+	for (int i = 0; i < ir->count; i++)
+	{
+		IrInstruction* instruction = &ir->instructions[i];
+		if (instruction->removed || instruction->height < 0)
+			continue;
+
+		int height = instruction->height;
+		if (instruction->leader)
+		{
+			// Nothing is known about what other blocks left behind
+			for (int slot = 0; slot < height; slot++)
+			{
+				assign(&numbering, slot, newNumber(&numbering), height);
+				numbering.pure[slot] = false;
+			}
+		}
+
+		if (instruction->rewritten)
+		{
+			pushValue(&numbering, height, newNumber(&numbering), i, false);
+			continue;
+		}
+
+		uint8_t op = instruction->op;
+		switch (op)
+		{
+		case OP_GET_LOCAL:
+			pushValue(&numbering, height, numbering.numbers[operand(ir, i)], i, true);
+			break;
+		case OP_CONSTANT:
+			pushValue(&numbering, height, lookupNumber(&numbering, op, ir->canonical[operand(ir, i)], 0, 0), i, true);
+			break;
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+			pushValue(&numbering, height, lookupNumber(&numbering, op, 0, 0, 0), i, true);
+			break;
+		case OP_GET_UPVALUE:
+			pushValue(&numbering, height, lookupNumber(&numbering, op, operand(ir, i), numbering.upvalueEpoch, 0), i, true);
+			reuseValue(ir, &numbering, i, height);
+			break;
+		case OP_GET_GLOBAL:
+			pushValue(&numbering, height, lookupNumber(&numbering, op, ir->canonical[operand(ir, i)], numbering.globalEpoch, 0), i, true);
+			reuseValue(ir, &numbering, i, height);
+			break;
+		case OP_SET_LOCAL:
+			assign(&numbering, operand(ir, i), numbering.numbers[height - 1], height);
+			numbering.pure[height - 1] = false;
+			break;
+		case OP_ADD_LOCAL:
+		case OP_INC_LOCAL:
+			assign(&numbering, operand(ir, i), newNumber(&numbering), height);
+			break;
+		case OP_SET_GLOBAL:
+			numbering.globalEpoch++;
+			numbering.pure[height - 1] = false;
+			break;
+		case OP_SET_UPVALUE:
+			numbering.upvalueEpoch++;
+			numbering.pure[height - 1] = false;
+			break;
+		default:
+		{
+			int pops, pushes;
+			stackEffect(ir, i, &pops, &pushes);
+			int slot = height - pops;
+
+			if (isPureOp(op))
+			{
+				int count = operandCount(op);
+				int left = numbering.numbers[height - count];
+				int right = count == 2 ? numbering.numbers[height - 1] : 0;
+				bool pure = numbering.pure[height - count] && numbering.pure[height - 1];
+				pushValue(&numbering, slot, lookupNumber(&numbering, op, 0, left, right), numbering.starts[height - count], pure);
+				reuseValue(ir, &numbering, i, slot);
+				break;
+			}
+
+			if (op == OP_DEFINE_GLOBAL)
+				numbering.globalEpoch++;
+
+			if (isCall(op))
+			{
+				// The callee can change globals, upvalues, and through them any captured local
+				numbering.globalEpoch++;
+				numbering.upvalueEpoch++;
+				for (int captured = 0; captured < slot && captured < UINT8_COUNT; captured++)
+				{
+					if (ir->captured[captured])
+						assign(&numbering, captured, newNumber(&numbering), slot);
+				}
+			}
+
+			if (pushes == 1)
+				pushValue(&numbering, slot, newNumber(&numbering), i, false);
+			break;
+		}
+		}
+	}
+
+	FREE_ARRAY(ValueKey, numbering.keys, numbering.capacity);
+	FREE_ARRAY(int, numbering.holders, numbering.holderCapacity);
+	FREE_ARRAY(int, numbering.numbers, ir->maxHeight + 1);
+	FREE_ARRAY(int, numbering.starts, ir->maxHeight + 1);
+	FREE_ARRAY(bool, numbering.pure, ir->maxHeight + 1);
+}
+
+// Lowering back to bytecode
+
+typedef struct
+{
+	uint8_t* code;
+	LineTable lines;
+	int count;
+	bool failed; // Something no longer fits in its operand
+} Emitter;
+
+static void emitByte(Emitter* emitter, int byte, int line)
+{
+	if (byte > UINT8_MAX)
+		emitter->failed = true;
+
+	emitter->code[emitter->count] = (uint8_t)byte;
+	writeLine(&emitter->lines, emitter->count, line);
+	emitter->count++;
+}
+
+// Whether byte i of an instruction is a local's slot
+static bool isSlotOperand(uint8_t op, uint8_t* code, int i)
+{
+	switch (op)
+	{
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_ADD_LOCAL:
+	case OP_INC_LOCAL:
+	case OP_JUMP_IF_NOT_LESS_CONST:
+	case OP_JUMP_IF_NOT_GREATER_CONST:
+		return i == 1;
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_NOT_GREATER:
+		return i == 1 || i == 2;
+	case OP_CLOSURE:
+		return i >= 3 && i % 2 == 1 && code[i - 1]; // A local captured by index
+	default:
+		return false;
+	}
+}
+
+// The original instruction, with its slots renumbered around the temporaries
+static void emitCopy(IrFunction* ir, Emitter* emitter, int index)
+{
+	IrInstruction* instruction = &ir->instructions[index];
+	uint8_t* code = ir->chunk->code + instruction->offset;
+	int line = getLine(&ir->chunk->lines, instruction->offset);
+
+	emitByte(emitter, instruction->op, line);
+	for (int i = 1; i < instruction->length; i++)
+	{
+		emitByte(emitter, isSlotOperand(instruction->op, code, i) ? renumber(ir, code[i]) : code[i], line);
+	}
+}
+
+// Inlined code keeps using its own constants, so they're added to the caller's
+static int constantFor(IrFunction* ir, Value value)
+{
+	ValueArray* constants = &ir->chunk->constants;
+	for (int i = 0; i < constants->count; i++)
+	{
+		if (valuesEqual(constants->values[i], value))
+			return i;
+	}
+
+	return addConstant(ir->chunk, value);
+}
+
+static int inlinedLength(ObjFunction* function)
+{
+	return 5 + function->chunk.count - 1 + 2; // The guard, the body without its OP_RETURN, then OP_INLINE_RETURN
+}
+
+// resume is where a real call returns to, right after the inlined body
+static void emitInlined(IrFunction* ir, Emitter* emitter, int index, int resume)
+{
+	IrInstruction* instruction = &ir->instructions[index];
+	ObjFunction* function = instruction->inlined;
+	Chunk* body = &function->chunk;
+	int line = getLine(&ir->chunk->lines, instruction->offset); // Errors in the body are reported at the call
+	int base = instruction->height - function->arity - 1; // The callee's slot 0
+
+	int offset = emitter->count;
+	int jump = resume - (offset + 5);
+	emitByte(emitter, OP_INLINE_GUARD, line);
+	emitByte(emitter, function->arity, line);
+	emitByte(emitter, constantFor(ir, OBJ_VAL(function)), line);
+	emitByte(emitter, (jump >> 8) & 0xff, line);
+	emitByte(emitter, jump & 0xff, line);
+	if (jump > UINT16_MAX)
+		emitter->failed = true;
+
+	for (int at = 0; at < body->count - 1; at += instructionLength(body, at))
+	{
+		uint8_t op = body->code[at];
+		emitByte(emitter, op, line);
+
+		switch (op)
+		{
+		case OP_GET_LOCAL:
+			emitByte(emitter, renumber(ir, base + body->code[at + 1]), line);
+			break;
+		case OP_CONSTANT:
+		case OP_GET_GLOBAL:
+		case OP_GET_PROPERTY:
+			emitByte(emitter, constantFor(ir, body->constants.values[body->code[at + 1]]), line);
+			break;
+		default:
+			for (int i = 1; i < instructionLength(body, at); i++)
+			{
+				emitByte(emitter, body->code[at + i], line);
+			}
+			break;
+		}
+	}
+
+	emitByte(emitter, OP_INLINE_RETURN, line);
+	emitByte(emitter, function->arity, line);
+}
+
+static int hoistLength(IrFunction* ir, Hoist* hoisted)
+{
+	int length = 3; // OP_SET_LOCAL temp, OP_POP
+	for (int i = hoisted->start; i <= hoisted->end; i++)
+	{
+		length += ir->instructions[i].length;
+	}
+	return length;
+}
+
+static void lower(IrFunction* ir)
+{
+	// Jumps forward to a loop's header run its hoisted code, while the loop's own back edges skip it
+	int* outside = ALLOCATE(int, ir->count + 1);
+	int* inside = ALLOCATE(int, ir->count + 1);
+
+	int size = ir->hoistCount; // An OP_NIL for each temporary, pushed on entry
+	for (int i = 0; i < ir->count; i++)
+	{
+		outside[i] = size;
+		for (int j = 0; j < ir->hoistCount; j++)
+		{
+			if (ir->hoists[j].header == i)
+				size += hoistLength(ir, &ir->hoists[j]);
+		}
+
+		inside[i] = size;
+		IrInstruction* instruction = &ir->instructions[i];
+		if (instruction->inlined != NULL)
+			size += inlinedLength(instruction->inlined);
+		else if (!instruction->removed)
+			size += instruction->rewritten ? 2 : instruction->length;
+	}
+	outside[ir->count] = size;
+	inside[ir->count] = size;
+
+	Emitter emitter;
+	emitter.code = ALLOCATE(uint8_t, size);
+	initLineTable(&emitter.lines);
+	emitter.count = 0;
+	emitter.failed = false;
+
+	for (int i = 0; i < ir->hoistCount; i++)
+	{
+		emitByte(&emitter, OP_NIL, getLine(&ir->chunk->lines, 0));
+	}
+
+	for (int i = 0; i < ir->count; i++)
+	{
+		IrInstruction* instruction = &ir->instructions[i];
+		int line = getLine(&ir->chunk->lines, instruction->offset);
+
+		for (int j = 0; j < ir->hoistCount; j++)
+		{
+			Hoist* hoisted = &ir->hoists[j];
+			if (hoisted->header != i)
+				continue;
+
+			for (int k = hoisted->start; k <= hoisted->end; k++)
+			{
+				emitCopy(ir, &emitter, k);
+			}
+			emitByte(&emitter, OP_SET_LOCAL, line);
+			emitByte(&emitter, ir->firstLocal + j, line);
+			emitByte(&emitter, OP_POP, line);
+		}
+
+		if (instruction->removed)
+			continue;
+
+		if (instruction->inlined != NULL)
+		{
+			emitInlined(ir, &emitter, i, outside[i + 1]);
+			continue;
+		}
+
+		if (instruction->rewritten)
+		{
+			emitByte(&emitter, OP_GET_LOCAL, line);
+			emitByte(&emitter, instruction->temp ? ir->firstLocal + instruction->slot : renumber(ir, instruction->slot), line);
+			continue;
+		}
+
+		int offset = emitter.count;
+		emitCopy(ir, &emitter, i);
+
+		if (isJump(instruction->op))
+		{
+			int end = offset + instruction->length;
+			int jump = instruction->op == OP_LOOP ? end - inside[instruction->target] : outside[instruction->target] - end;
+			if (jump > UINT16_MAX)
+				emitter.failed = true;
+			emitter.code[end - 2] = (jump >> 8) & 0xff;
+			emitter.code[end - 1] = jump & 0xff;
+		}
+	}
+
+	FREE_ARRAY(int, outside, ir->count + 1);
+	FREE_ARRAY(int, inside, ir->count + 1);
+
+	// Leave the chunk as it was rather than produce something that doesn't encode
+	if (emitter.failed)
+	{
+		FREE_ARRAY(uint8_t, emitter.code, size);
+		freeLineTable(&emitter.lines);
+		return;
+	}
+
+	Chunk* chunk = ir->chunk;
+	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+	freeLineTable(&chunk->lines);
+	chunk->code = emitter.code;
+	chunk->lines = emitter.lines;
+	chunk->count = size;
+	chunk->capacity = size;
+}
+
+// The passes only know one-byte operands, so functions big enough to need wider ones are left alone
+static bool hasWideOperands(Chunk* chunk)
+{
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+	{
+		if (chunk->code[offset] == OP_WIDE || chunk->code[offset] == OP_CONSTANT_LONG)
+			return true;
+	}
+
+	return false;
+}
+
+void optimizeFunction(ObjFunction* function)
+{
+	if (hasWideOperands(&function->chunk))
+		return;
+
+	IrFunction ir;
+	buildIr(&ir, function);
+
+	inferTypes(&ir);
+	hoistLoops(&ir);
+	findInlineCalls(&ir);
+	numberValues(&ir);
+
+	if (ir.changed)
+		lower(&ir);
+
+	freeIr(&ir);
+}
@@ -0,0 +1,15 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+
+#include "object.h"
+
+// Function-wide passes, run with -O before the peephole pass
+// The finished chunk is split into basic blocks with the stack height at each instruction, optimized, then lowered back to bytecode
+void optimizeFunction(ObjFunction* function);
+
+// Top-level functions compiled so far, which calls compiled after them can inline. Only lives as long as one compile
+void beginInlining();
+void endInlining();
+void noteGlobalFunction(ObjString* name, ObjFunction* function);
+
+#endif
@@ -3,8 +3,12 @@
 #include <string.h>
 
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "mapping.h"
+#include "snapshot.h"
 #include "vm.h"
 
 static void repl()
@@ -20,48 +24,21 @@ static void repl()
 			break;
 		}
 
-		interpret(line);
+		interpret(line, strlen(line));
 	}
 }
 
-static char* readFile(const char* path)
+// Mapped rather than read, so even a huge generated script is compiled in place without a copy
+// The caller unmaps the source, since lazy functions compile from it whenever they're first called
+static void runFile(const char* path, MappedFile* source)
 {
-	FILE* file = fopen(path, "rb");
-	if (file == NULL)
+	if (!mapFile(path, source))
 	{
 		fprintf(stderr, "Could not open file \"%s\".\n", path);
 		exit(74);
 	}
 
-	fseek(file, 0L, SEEK_END);
-	size_t fileSize = ftell(file);
-	rewind(file);
-
-	char* buffer = (char*)malloc(fileSize + 1);
-	if (buffer == NULL)
-	{
-		fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-		exit(74);
-	}
-
-	size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-	if (bytesRead < fileSize)
-	{
-		fprintf(stderr, "Could not read file \"%s\".\n", path);
-		exit(74);
-	}
-
-	buffer[bytesRead] = '\0';
-
-	fclose(file);
-	return buffer;
-}
-
-static void runFile(const char* path)
-{
-	char* source = readFile(path);
-	InterpretResult result = interpret(source);
-	free(source);
+	InterpretResult result = interpret(source->bytes, source->length);
 
 	if (result == INTERPRET_COMPILE_ERROR) exit(65);
 	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
@@ -71,17 +48,65 @@ int main(int argc, const char* argv[])
 {
 	initVM();
 
-	if (argc == 1)
+#ifdef DEBUG_HASH_TEST
+	exit(testStringHash() ? 0 : 70);
+#endif
+
+	int arg = 1;
+	if (arg < argc && strcmp(argv[arg], "-O") == 0)
+	{
+		optimizeIR = true; // Slower compiles, faster long-running scripts
+		arg++;
+	}
+	if (arg < argc && strcmp(argv[arg], "-l") == 0)
 	{
+		lazyFunctions = true; // Faster start for scripts that only call some of their functions
+		arg++;
+	}
+	if (arg + 1 < argc && strcmp(argv[arg], "-c") == 0)
+	{
+		cacheDirectory = argv[arg + 1]; // Has to exist already
+		arg += 2;
+	}
+	const char* restorePath = NULL;
+	if (arg + 1 < argc && strcmp(argv[arg], "-r") == 0)
+	{
+		restorePath = argv[arg + 1];
+		arg += 2;
+	}
+	const char* savePath = NULL;
+	if (arg + 1 < argc && strcmp(argv[arg], "-s") == 0)
+	{
+		savePath = argv[arg + 1];
+		arg += 2;
+	}
+
+	// Globals from an earlier run, so this one can skip setting them up again
+	if (restorePath != NULL && !restoreSnapshot(restorePath))
+	{
+		fprintf(stderr, "Could not restore snapshot \"%s\".\n", restorePath);
+		exit(74);
+	}
+
+	if (arg == argc)
+	{
+		lazyFunctions = false; // Each line overwrites the last one's source
 		repl();
 	}
-	else if (argc == 2)
+	else if (arg == argc - 1)
 	{
-		runFile(argv[1]);
+		MappedFile source;
+		runFile(argv[arg], &source);
+		if (savePath != NULL && !saveSnapshot(savePath))
+		{
+			fprintf(stderr, "Could not write snapshot \"%s\".\n", savePath);
+			exit(74);
+		}
+		unmapFile(&source);
 	}
 	else
 	{
-		fprintf(stderr, "Usage: clox [path]\n");
+		fprintf(stderr, "Usage: clox [-O] [-l] [-c cachedir] [-r snapshot] [-s snapshot] [path]\n");
 		exit(64);
 	}
 
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+
+#include "mapping.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Grows the buffer as it goes, since a pipe's size isn't known until it's drained
+static bool readAll(bool (*readChunk)(void* handle, char* buffer, size_t size, size_t* count), void* handle, MappedFile* file)
+{
+	size_t capacity = 4096;
+	size_t length = 0;
+	char* buffer = (char*)malloc(capacity);
+	if (buffer == NULL)
+		return false;
+
+	for (;;)
+	{
+		if (length == capacity)
+		{
+			capacity *= 2;
+			char* grown = (char*)realloc(buffer, capacity);
+			if (grown == NULL)
+			{
+				free(buffer);
+				return false;
+			}
+			buffer = grown;
+		}
+
+		size_t count;
+		if (!readChunk(handle, buffer + length, capacity - length, &count))
+		{
+			free(buffer);
+			return false;
+		}
+		if (count == 0)
+			break;
+		length += count;
+	}
+
+	file->bytes = buffer;
+	file->length = length;
+	file->copied = true;
+	return true;
+}
+
+#ifdef _WIN32
+static bool readHandle(void* handle, char* buffer, size_t size, size_t* count)
+{
+	DWORD bytesRead;
+	DWORD request = size > MAXDWORD ? MAXDWORD : (DWORD)size;
+	if (!ReadFile((HANDLE)handle, buffer, request, &bytesRead, NULL))
+	{
+		*count = 0;
+		return GetLastError() == ERROR_BROKEN_PIPE; // The writer closed its end
+	}
+
+	*count = bytesRead;
+	return true;
+}
+#else
+static bool readDescriptor(void* handle, char* buffer, size_t size, size_t* count)
+{
+	ssize_t bytesRead = read(*(int*)handle, buffer, size);
+	if (bytesRead < 0)
+		return false;
+
+	*count = (size_t)bytesRead;
+	return true;
+}
+#endif
+
+bool mapFile(const char* path, MappedFile* file)
+{
+	file->bytes = NULL;
+	file->length = 0;
+	file->copied = false;
+
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (GetFileType(handle) != FILE_TYPE_DISK)
+	{
+		bool loaded = readAll(readHandle, handle, file);
+		CloseHandle(handle);
+		return loaded;
+	}
+
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(handle, &size))
+	{
+		file->length = (size_t)size.QuadPart;
+		if (size.QuadPart == 0)
+		{
+			file->bytes = "";
+		}
+		else
+		{
+			HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping != NULL)
+			{
+				file->bytes = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				CloseHandle(mapping); // The view keeps it alive
+			}
+		}
+	}
+	CloseHandle(handle);
+	return file->bytes != NULL;
+#else
+	int descriptor = open(path, O_RDONLY);
+	if (descriptor < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(descriptor, &info) != 0)
+	{
+		close(descriptor);
+		return false;
+	}
+
+	// Pipes, /dev/stdin and <(...) report a size of 0, so mapping them would read as an empty script
+	if (!S_ISREG(info.st_mode))
+	{
+		bool loaded = readAll(readDescriptor, &descriptor, file);
+		close(descriptor);
+		return loaded;
+	}
+
+	file->length = (size_t)info.st_size;
+	if (info.st_size == 0)
+	{
+		file->bytes = "";
+	}
+	else
+	{
+		void* mapped = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, descriptor, 0);
+		if (mapped != MAP_FAILED)
+			file->bytes = (const char*)mapped;
+	}
+	close(descriptor); // The mapping keeps it alive
+	return file->bytes != NULL;
+#endif
+}
+
+void unmapFile(MappedFile* file)
+{
+	if (file->copied)
+	{
+		free((void*)file->bytes);
+	}
+	else if (file->length > 0) // An empty file was never mapped
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(file->bytes);
+#else
+		munmap((void*)file->bytes, file->length);
+#endif
+	}
+
+	file->bytes = NULL;
+	file->length = 0;
+}
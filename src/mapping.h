@@ -0,0 +1,19 @@
+#ifndef clox_mapping_h
+#define clox_mapping_h
+
+#include "common.h"
+
+typedef struct
+{
+	const char* bytes;
+	size_t length;
+	bool copied; // Read into a heap buffer instead, since pipes and terminals can't be mapped
+} MappedFile;
+
+// Maps a whole file read-only, so its bytes come straight from the page cache without a copy
+// Anything that isn't a regular file is read to its end instead. An empty file comes back as "" with a length of 0
+// False if it can't be opened, mapped or read
+bool mapFile(const char* path, MappedFile* file);
+void unmapFile(MappedFile* file);
+
+#endif
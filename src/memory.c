@@ -1,6 +1,8 @@
 #include <stdlib.h>
 
+#include "compiler.h"
 #include "memory.h"
+#include "snapshot.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -9,8 +11,9 @@
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+#define GC_HEAP_MIN (1024 * 1024) // Sweeping walks every page, so don't collect a tiny heap over and over
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+static void trackAllocation(size_t oldSize, size_t newSize)
 {
 	vm.bytesAllocated += newSize - oldSize;
 	if (newSize > oldSize)
@@ -19,13 +22,20 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
 #ifdef DEBUG_STRESS_GC
 		collectGarbage();
 #endif
-	}
 
-	if (vm.bytesAllocated > vm.nextGC)
-	{
-		collectGarbage();
-		vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+		if (vm.bytesAllocated > vm.nextGC)
+		{
+			collectGarbage();
+			vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+			if (vm.nextGC < GC_HEAP_MIN)
+				vm.nextGC = GC_HEAP_MIN;
+		}
 	}
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+{
+	trackAllocation(oldSize, newSize);
 
 	if (newSize == 0)
 	{
@@ -43,59 +53,81 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
 	return result;
 }
 
+void* allocateObjectMemory(size_t size)
+{
+	trackAllocation(0, size);
+	return heapAllocate(size);
+}
+
+void freeObjectMemory(void* pointer, size_t size)
+{
+	trackAllocation(size, 0);
+	heapFree(pointer, size);
+}
+
 static void freeObject(Obj* object)
 {
 #ifdef DEBUG_LOG_GC
-	printf("%p free type %d\n", (void*)object, object->type);
+	printf("%p free type %d\n", (void*)object, HEADER_TYPE(object));
 #endif
 
-	switch (object->type)
+	switch (HEADER_TYPE(object))
 	{
 	case OBJ_BOUND_METHOD:
-		FREE(ObjBoundMethod, object);
+		FREE_OBJ(ObjBoundMethod, object);
 		break;
 	case OBJ_CLASS:
 	{
 		ObjClass* klass = (ObjClass*)object;
 		freeTable(&klass->methods);
-		FREE(ObjClass, object);
+		FREE_OBJ(ObjClass, object);
 		break;
 	}
 	case OBJ_CLOSURE:
 	{
-		FREE(ObjClosure, object);
 		ObjClosure* closure = (ObjClosure*)object;
-		FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+		freeObjectMemory(object, CLOSURE_SIZE(closure->upvalueCount));
 		break;
 	}
 	case OBJ_FUNCTION:
 	{
 		ObjFunction* function = (ObjFunction*)object;
 		freeChunk(&function->chunk);
-		FREE(ObjFunction, object);
+		freeLazyFunction(function);
+		FREE_OBJ(ObjFunction, object);
 		break;
 	}
 	case OBJ_INSTANCE:
 	{
 		ObjInstance* instance = (ObjInstance*)object;
 		freeTable(&instance->fields);
-		FREE(ObjInstance, object);
+		FREE_OBJ(ObjInstance, object);
 		break;
 	}
 	case OBJ_NATIVE:
 	{
-		FREE(ObjNative, object);
+		FREE_OBJ(ObjNative, object);
+		break;
+	}
+	case OBJ_ROPE:
+	{
+		ObjRope* rope = (ObjRope*)object;
+		if (rope->owner == rope)
+			FREE_ARRAY(char, rope->chars, rope->capacity);
+		FREE_OBJ(ObjRope, object);
 		break;
 	}
 	case OBJ_STRING:
 	{
 		ObjString* string = (ObjString*)object;
-		FREE_ARRAY(char, string->chars, string->length + 1);
-		FREE(ObjString, object);
+		freeObjectMemory(object, STRING_SIZE(string->length));
 		break;
 	}
 	case OBJ_UPVALUE:
-		FREE(ObjUpvalue, object);
+		FREE_OBJ(ObjUpvalue, object);
+		break;
+	case OBJ_VIEW:
+		FREE_OBJ(ObjView, object);
 		break;
 	}
 }
@@ -104,7 +136,7 @@ void markObject(Obj* object)
 {
 	if (object == NULL)
 		return;
-	if (object->isMarked)
+	if (IS_MARKED(object))
 		return;
 
 #ifdef DEBUG_LOG_GC
@@ -113,7 +145,7 @@ void markObject(Obj* object)
 	printf("n");
 #endif
 
-	object->isMarked = true;
+	object->header |= OBJ_MARKED;
 
 	if (vm.grayCapacity < vm.grayCount + 1)
 	{
@@ -150,7 +182,7 @@ static void	blackenObject(Obj* object)
 	printf("\n");
 #endif
 
-	switch (object->type)
+	switch (HEADER_TYPE(object))
 	{
 	case OBJ_BOUND_METHOD:
 	{
@@ -172,8 +204,9 @@ static void	blackenObject(Obj* object)
 		markObject((Obj*)closure->function);
 		for (int i = 0; i < closure->upvalueCount; i++)
 		{
-			markObject((Obj*)closure->upvalues[i]);
+			markObject((Obj*)FROM_REF(ObjUpvalue, closure->upvalues[i]));
 		}
+		break;
 	}
 	case OBJ_FUNCTION:
 	{
@@ -189,9 +222,15 @@ static void	blackenObject(Obj* object)
 		markTable(&instance->fields);
 		break;
 	}
+	case OBJ_ROPE:
+		markObject((Obj*)((ObjRope*)object)->owner);
+		break;
 	case OBJ_UPVALUE:
 		markValue(((ObjUpvalue*)object)->closed);
 		break;
+	case OBJ_VIEW:
+		markObject(((ObjView*)object)->parent);
+		break;
 	case OBJ_NATIVE:
 	case OBJ_STRING:
 		break;
@@ -210,13 +249,14 @@ static void markRoots()
 		markObject((Obj*)vm.frames[i].closure);
 	}
 
-	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue->next)
+	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = FROM_REF(ObjUpvalue, upvalue->next))
 	{
 		markObject((Obj*)upvalue);
 	}
 
 	markTable(&vm.globals);
 	markCompilerRoots();
+	markSnapshotRoots();
 	markObject((Obj*)vm.initString);
 }
 
@@ -231,33 +271,55 @@ static void traceReferences()
 
 static void sweep()
 {
-	Obj* previous = NULL;
-	Obj* object = vm.objects;
+	heapBeginSweep();
 
-	while (object != NULL)
+	HeapPage* page = heap.pages;
+	while (page != NULL)
 	{
-		if (object->isMarked)
+		// Freeing a large object or an empty page releases it, so nothing is read from the page after that
+		HeapPage* next = page->next;
+
+		if (page->slotSize > HEAP_SMALL_MAX)
 		{
-			object->isMarked = false;
-			previous = object;
-			object = object->next;
+			Obj* object = (Obj*)page->slots;
+			if (IS_MARKED(object))
+				object->header &= ~(uint64_t)OBJ_MARKED;
+			else
+				freeObject(object);
+			page = next;
+			continue;
 		}
-		else
+
+		// Free slots are linked up from the end, so the free list hands out the lowest address first
+		HeapBlock* firstFree = NULL;
+		HeapBlock* lastFree = NULL;
+		bool empty = true;
+		for (int i = (int)page->slotCount - 1; i >= 0; i--)
 		{
-			Obj* unreached = object;
-			object = object->next;
-			if (previous != NULL)
-			{
-				previous->next = object;
-			}
-			else
+			Obj* object = (Obj*)PAGE_SLOT(page, i);
+			if (!isFreeSlot(object))
 			{
-				vm.objects = object;
+				if (IS_MARKED(object))
+				{
+					object->header &= ~(uint64_t)OBJ_MARKED;
+					empty = false;
+					continue;
+				}
+				freeObject(object);
 			}
 
-			freeObject(unreached);
+			HeapBlock* block = (HeapBlock*)object;
+			block->next = firstFree;
+			firstFree = block;
+			if (lastFree == NULL)
+				lastFree = block;
 		}
+
+		heapSweptPage(page, firstFree, lastFree, empty);
+		page = next;
 	}
+
+	heapEndSweep();
 }
 
 void collectGarbage()
@@ -280,12 +342,18 @@ void collectGarbage()
 
 void freeObjects()
 {
-	Obj* object = vm.objects;
-	while (object != NULL)
+	HeapPage* page = heap.pages;
+	while (page != NULL)
 	{
-		Obj* next = object->next;
-		freeObject(object);
-		object = next;
+		HeapPage* next = page->next;
+		uint32_t slotCount = page->slotCount; // Freeing a large object frees its page too
+		for (uint32_t i = 0; i < slotCount; i++)
+		{
+			Obj* object = (Obj*)PAGE_SLOT(page, i);
+			if (!isFreeSlot(object))
+				freeObject(object);
+		}
+		page = next;
 	}
 
 	free(vm.grayStack);
@@ -8,6 +8,7 @@
  (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE_OBJ(type, pointer) freeObjectMemory(pointer, sizeof(type))
 
 // Parentheses around capacity is needed in case it's an expression and we need to avoid order of operations
 #define GROW_CAPACITY(capacity) \
@@ -30,6 +31,9 @@
 	Non-0    / >oldSize / Grow allocation
 */
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+// Objects go through these instead of reallocate(), so they end up in the heap's pages
+void* allocateObjectMemory(size_t size);
+void freeObjectMemory(void* pointer, size_t size);
 void markObject(Obj* object);
 void markValue(Value value);
 void collectGarbage();
@@ -12,12 +12,8 @@
 
 static Obj* allocateObject(size_t size, ObjType type)
 {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
-	object->type = type;
-	object->isMarked = false;
-
-	object->next = vm.objects;
-	vm.objects = object;
+	Obj* object = (Obj*)allocateObjectMemory(size);
+	object->header = (uint64_t)type;
 
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %zu for %d\n", (void*)object, size, type); // %zu is size
@@ -45,17 +41,15 @@ ObjClass* newClass(ObjString* name)
 
 ObjClosure* newClosure(ObjFunction* function)
 {
-	ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+	ObjClosure* closure = (ObjClosure*)allocateObject(CLOSURE_SIZE(function->upvalueCount), OBJ_CLOSURE);
+	closure->function = function;
+	closure->upvalueCount = function->upvalueCount;
+
 	for (int i = 0; i < function->upvalueCount; i++)
 	{
-		upvalues[i] = NULL;
+		closure->upvalues[i] = NULL_REF;
 	}
 
-	ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-	closure->function = function;
-	closure->upvalues = upvalues;
-	closure->upvalueCount = function->upvalueCount;
-
 	return closure;
 }
 
@@ -64,7 +58,13 @@ ObjFunction* newFunction()
 	ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 	function->arity = 0;
 	function->upvalueCount = 0;
+	function->localCount = 0;
+	function->accessor = ACCESSOR_NONE;
+	function->accessorField = 0;
 	function->name = NULL;
+	function->image = NULL;
+	function->imageFunction = 0;
+	function->lazy = NULL;
 	initChunk(&function->chunk);
 	return function;
 }
@@ -84,45 +84,217 @@ ObjNative* newNative(NativeFn function)
 	return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash)
+// The buffer is allocated before the object so a GC in between can't sweep the new rope
+ObjRope* newRope(const char* a, int aLength, const char* b, int bLength)
+{
+	int length = aLength + bLength;
+	int capacity = GROW_CAPACITY(length);
+	char* chars = ALLOCATE(char, capacity);
+	memcpy(chars, a, aLength);
+	memcpy(chars + aLength, b, bLength);
+
+	ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+	rope->length = length;
+	rope->owner = rope;
+	rope->chars = chars;
+	rope->count = length;
+	rope->capacity = capacity;
+	return rope;
+}
+
+ObjRope* appendRope(ObjRope* rope, const char* chars, int length)
+{
+	ObjRope* owner = rope->owner;
+
+	if (rope->length != owner->count)
+	{
+		// Something was already appended past this rope, so those chars aren't ours to overwrite
+		return newRope(owner->chars, rope->length, chars, length);
+	}
+
+	int newCount = owner->count + length;
+	if (newCount > owner->capacity)
+	{
+		int capacity = owner->capacity;
+		while (capacity < newCount)
+			capacity = GROW_CAPACITY(capacity);
+
+		// Not GROW_ARRAY - chars may point into the old buffer (ex: s + s), so copy it before freeing
+		char* grown = ALLOCATE(char, capacity);
+		memcpy(grown, owner->chars, owner->count);
+		memcpy(grown + owner->count, chars, length);
+		FREE_ARRAY(char, owner->chars, owner->capacity);
+
+		owner->chars = grown;
+		owner->capacity = capacity;
+	}
+	else
+	{
+		memcpy(owner->chars + owner->count, chars, length);
+	}
+	owner->count = newCount;
+
+	ObjRope* result = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+	result->length = newCount;
+	result->owner = owner;
+	result->chars = NULL;
+	result->count = 0;
+	result->capacity = 0;
+	return result;
+}
+
+// Only two interned strings can be compared by pointer. Anything else falls back to comparing the chars
+bool stringsEqual(Value a, Value b)
 {
-	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+	if (IS_STRING(a) && IS_STRING(b))
+	{
+		ObjString* aString = AS_STRING(a);
+		ObjString* bString = AS_STRING(b);
+		if (aString == bString)
+			return true;
+		if (aString->isInterned && bString->isInterned)
+			return false;
+	}
+
+	char aBuffer[SHORT_STRING_MAX], bBuffer[SHORT_STRING_MAX];
+	int aLength, bLength;
+	const char* aChars = stringChars(a, aBuffer, &aLength);
+	const char* bChars = stringChars(b, bBuffer, &bLength);
+	return aLength == bLength && memcmp(aChars, bChars, aLength) == 0;
+}
+
+// Creates an uninterned string with room for length chars, to be filled in place
+// Runtime strings stay uninterned - they're only compared and printed, so hashing them and probing vm.strings is wasted work
+ObjString* allocateString(int length)
+{
+	ObjString* string = (ObjString*)allocateObject(STRING_SIZE(length), OBJ_STRING);
 	string->length = length;
-	string->chars = chars;
+	string->hash = 0; // Only computed once the string is interned
+	string->isInterned = false;
+	string->chars[length] = '\0'; // Adding a terminator lets us pass the chars to C functions that expect a terminated string
+
+	return string;
+}
+
+static ObjString* internString(ObjString* string, uint32_t hash)
+{
 	string->hash = hash;
+	string->isInterned = true;
 
 	push(OBJ_VAL(string));
 	tableSet(&vm.strings, string, NIL_VAL);
-	pop(string);
+	pop();
 
 	return string;
 }
 
+// Primes from xxHash. Mixing a full 64-bit word per multiply is far cheaper than FNV-1a's multiply per byte
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotateLeft(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+// memcpy instead of a pointer cast - chars has no alignment guarantee. Compilers turn this into a single load
+static inline uint64_t readWord(const char* chars)
+{
+	uint64_t word;
+	memcpy(&word, chars, sizeof(uint64_t));
+	return word;
+}
+
+static inline uint32_t readHalfWord(const char* chars)
+{
+	uint32_t word;
+	memcpy(&word, chars, sizeof(uint32_t));
+	return word;
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input)
+{
+	acc += input * HASH_PRIME2;
+	acc = rotateLeft(acc, 31);
+	return acc * HASH_PRIME1;
+}
+
+static inline uint64_t hashMergeLane(uint64_t hash, uint64_t lane)
+{
+	hash ^= hashRound(0, lane);
+	return hash * HASH_PRIME1 + HASH_PRIME4;
+}
+
 static uint32_t	hashString(const char* key, int length)
 {
-	uint32_t hash = 2166136261u;
-	for (int i = 0; i < length; i++)
+	const char* end = key + length;
+	uint64_t hash;
+
+	if (length >= 32)
 	{
-		hash ^= (uint8_t)key[i]; // Mix bits in
-		hash *= 16777619; // Scramble bits around
+		// Long strings: four independent lanes so the multiplies can overlap in the pipeline (and vectorize where the compiler can)
+		uint64_t lane1 = HASH_PRIME1 + HASH_PRIME2;
+		uint64_t lane2 = HASH_PRIME2;
+		uint64_t lane3 = 0;
+		uint64_t lane4 = 0 - HASH_PRIME1;
+
+		do
+		{
+			lane1 = hashRound(lane1, readWord(key));
+			lane2 = hashRound(lane2, readWord(key + 8));
+			lane3 = hashRound(lane3, readWord(key + 16));
+			lane4 = hashRound(lane4, readWord(key + 24));
+			key += 32;
+		}
+		while (key <= end - 32);
+
+		hash = rotateLeft(lane1, 1) + rotateLeft(lane2, 7) + rotateLeft(lane3, 12) + rotateLeft(lane4, 18);
+		hash = hashMergeLane(hash, lane1);
+		hash = hashMergeLane(hash, lane2);
+		hash = hashMergeLane(hash, lane3);
+		hash = hashMergeLane(hash, lane4);
+	}
+	else
+	{
+		hash = HASH_PRIME5;
 	}
-}
 
-ObjString* takeString(char* chars, int length)
-{
-	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+	hash += (uint64_t)length;
 
-	if (interned != NULL)
+	// Identifiers and short strings land here - a word at a time, then the tail
+	for (; key + 8 <= end; key += 8)
 	{
-		// No longer need the duplicate string
-		FREE_ARRAY(char, chars, length + 1);
-		return interned;
+		hash ^= hashRound(0, readWord(key));
+		hash = rotateLeft(hash, 27) * HASH_PRIME1 + HASH_PRIME4;
+	}
+
+	if (key + 4 <= end)
+	{
+		hash ^= (uint64_t)readHalfWord(key) * HASH_PRIME1;
+		hash = rotateLeft(hash, 23) * HASH_PRIME2 + HASH_PRIME3;
+		key += 4;
+	}
+
+	for (; key < end; key++)
+	{
+		hash ^= (uint8_t)*key * HASH_PRIME5;
+		hash = rotateLeft(hash, 11) * HASH_PRIME1;
 	}
 
-	return allocateString(chars, length, hash);
+	// Avalanche so the low bits (the ones Table masks with capacity - 1) depend on every input bit
+	hash ^= hash >> 33;
+	hash *= HASH_PRIME2;
+	hash ^= hash >> 29;
+	hash *= HASH_PRIME3;
+	hash ^= hash >> 32;
+
+	return (uint32_t)hash;
 }
 
+// Always interned. Table keys (identifiers, property names, natives) come from here, so pointer comparison finds them
 ObjString* copyString(const char* chars, int length)
 {
 	uint32_t hash = hashString(chars, length);
@@ -131,10 +303,17 @@ ObjString* copyString(const char* chars, int length)
 	if (interned != NULL)
 		return interned;
 
-	char* heapChars = ALLOCATE(char, length + 1);
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0'; // Adding a terminator lets us pass the char* to C functions that expect a terminated string
-	return allocateString(heapChars, length, hash);
+	ObjString* string = allocateString(length);
+	memcpy(string->chars, chars, length);
+	return internString(string, hash);
+}
+
+// A Lox string value for chars - short strings are packed into the value, longer ones are interned
+Value copyStringValue(const char* chars, int length)
+{
+	if (length <= SHORT_STRING_MAX)
+		return makeShortString(chars, length);
+	return OBJ_VAL(copyString(chars, length));
 }
 
 ObjUpvalue* newUpvalue(Value* slot)
@@ -142,10 +321,31 @@ ObjUpvalue* newUpvalue(Value* slot)
 	ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
 	upvalue->location = slot;
 	upvalue->closed = NIL_VAL;
-	upvalue->next = NULL;
+	upvalue->next = NULL_REF;
 	return upvalue;
 }
 
+// parent must be on the stack. Views of ropes and views point at the underlying chars, so they never chain
+ObjView* newView(Value parent, int start, int length)
+{
+	Obj* base = AS_OBJ(parent);
+	if (IS_VIEW(parent))
+	{
+		start += AS_VIEW(parent)->start;
+		base = AS_VIEW(parent)->parent;
+	}
+	else if (IS_ROPE(parent))
+	{
+		base = (Obj*)AS_ROPE(parent)->owner; // Rope chars never move relative to the owner's buffer
+	}
+
+	ObjView* view = ALLOCATE_OBJ(ObjView, OBJ_VIEW);
+	view->parent = base;
+	view->start = start;
+	view->length = length;
+	return view;
+}
+
 static void printFunction(ObjFunction* function)
 {
 	if (function->name == NULL)
@@ -179,11 +379,205 @@ void printObject(Value value)
 	case OBJ_NATIVE:
 		printf("<native fn>");
 		break;
+	case OBJ_ROPE:
+		printf("%.*s", AS_ROPE(value)->length, AS_ROPE(value)->owner->chars);
+		break;
 	case OBJ_STRING:
 		printf("%s", AS_CSTRING(value));
 		break;
 	case OBJ_UPVALUE:
 		printf("upvalue");
 		break;
+	case OBJ_VIEW:
+	{
+		char buffer[SHORT_STRING_MAX];
+		int length;
+		const char* chars = stringChars(value, buffer, &length);
+		printf("%.*s", length, chars);
+		break;
+	}
+	}
+}
+#ifdef DEBUG_HASH_TEST
+#include <stdlib.h>
+#include <time.h>
+
+#define HASH_TEST_CAPACITY 65536
+#define HASH_TEST_KEYS (HASH_TEST_CAPACITY / 4 * 3) // 75% load, the most a Table holds before it grows
+#define HASH_TEST_TEXT 4096
+
+// The old byte-at-a-time FNV-1a, to compare speed against
+static uint32_t hashFnv1a(const char* key, int length)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < length; i++)
+	{
+		hash ^= (uint8_t)key[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static const char* hashTestWords[] = {
+	"count", "index", "value", "node", "left", "right", "parent", "name", "list", "size",
+	"buffer", "total", "start", "end", "item", "key", "next", "prev", "result", "temp",
+};
+#define HASH_TEST_WORD_COUNT (int)(sizeof(hashTestWords) / sizeof(hashTestWords[0]))
+
+// Identifier-like names: camelCase pairs of common words, some with a number or underscore
+static int identifierKey(int n, char* buffer)
+{
+	const char* first = hashTestWords[n % HASH_TEST_WORD_COUNT];
+	const char* second = hashTestWords[n / HASH_TEST_WORD_COUNT % HASH_TEST_WORD_COUNT];
+	int suffix = n / (HASH_TEST_WORD_COUNT * HASH_TEST_WORD_COUNT);
+
+	int length = sprintf(buffer, "%s%c%s", first, second[0] - 'a' + 'A', second + 1);
+	if (suffix > 0)
+		length += sprintf(buffer + length, suffix % 2 ? "%d" : "_%d", suffix);
+	return length;
+}
+
+static int sequentialKey(int n, char* buffer)
+{
+	return sprintf(buffer, "key%d", n);
+}
+
+static volatile uint32_t hashTestSink; // So the hashing isn't optimized away
+
+// Times hashing every key rounds times over, in nanoseconds per key
+static double timeHash(uint32_t (*hash)(const char*, int), char** keys, int* lengths, int count, int rounds)
+{
+	uint32_t combined = 0;
+	clock_t start = clock();
+	for (int round = 0; round < rounds; round++)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			combined += hash(keys[i], lengths[i]);
+		}
+	}
+	double time = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ((double)count * rounds);
+
+	hashTestSink = combined;
+	return time;
+}
+
+static void benchmarkHash(const char* label, char** keys, int* lengths, int count, int rounds)
+{
+	double fnv = timeHash(hashFnv1a, keys, lengths, count, rounds);
+	double word = timeHash(hashString, keys, lengths, count, rounds);
+	printf("%-12s FNV-1a %8.1f ns   hashString %8.1f ns   (%.1fx)\n", label, fnv, word, fnv / word);
+}
+
+// Fills a Table to 75% load and compares how the keys spread over its buckets with a uniformly random hash
+static bool checkDistribution(const char* label, int (*makeKey)(int, char*))
+{
+	Table table;
+	initTable(&table);
+
+	char buffer[64];
+	for (int i = 0; i < HASH_TEST_KEYS; i++)
+	{
+		int length = makeKey(i, buffer);
+		tableSet(&table, copyString(buffer, length), NIL_VAL);
+	}
+
+	if (table.capacity != HASH_TEST_CAPACITY)
+	{
+		printf("%-12s expected capacity %d, got %d\n", label, HASH_TEST_CAPACITY, table.capacity);
+		return false;
 	}
-}
\ No newline at end of file
+
+	// Home buckets, and how far linear probing pushed each key past its own
+	int* homeCounts = calloc(HASH_TEST_CAPACITY, sizeof(int));
+	long probes = 0;
+	int longestProbe = 0;
+	for (int i = 0; i < HASH_TEST_CAPACITY; i++)
+	{
+		ObjString* key = FROM_REF(ObjString, table.entries[i].key);
+		if (key == NULL)
+			continue;
+
+		uint32_t home = key->hash & (HASH_TEST_CAPACITY - 1);
+		homeCounts[home]++;
+
+		int probe = (int)((i - home) & (HASH_TEST_CAPACITY - 1)) + 1;
+		probes += probe;
+		if (probe > longestProbe)
+			longestProbe = probe;
+	}
+
+	int empty = 0;
+	int fullest = 0;
+	for (int i = 0; i < HASH_TEST_CAPACITY; i++)
+	{
+		if (homeCounts[i] == 0)
+			empty++;
+		if (homeCounts[i] > fullest)
+			fullest = homeCounts[i];
+	}
+	free(homeCounts);
+	freeTable(&table);
+
+	// A uniform hash leaves e^-0.75 = 47.2% of the buckets nobody's home, and averages 2.5 probes per hit with linear probing
+	double emptyPercent = 100.0 * empty / HASH_TEST_CAPACITY;
+	double meanProbe = (double)probes / HASH_TEST_KEYS;
+	bool passed = emptyPercent > 46.2 && emptyPercent < 48.2 && meanProbe < 3.0;
+
+	printf("%-12s empty buckets %.1f%% (ideal 47.2%%)   fullest bucket %d   mean probe %.2f (ideal 2.50)   longest probe %d   %s\n",
+		label, emptyPercent, fullest, meanProbe, longestProbe, passed ? "ok" : "FAIL");
+	return passed;
+}
+
+// Benchmarks hashString against FNV-1a, then checks its bucket spread at 75% load. Returns whether the spread was good
+bool testStringHash()
+{
+	vm.nextGC = SIZE_MAX; // Nothing roots the test keys, so don't collect while the tables hold them
+
+	char** keys = malloc(sizeof(char*) * HASH_TEST_KEYS);
+	int* lengths = malloc(sizeof(int) * HASH_TEST_KEYS);
+	char buffer[64];
+	for (int i = 0; i < HASH_TEST_KEYS; i++)
+	{
+		lengths[i] = identifierKey(i, buffer);
+		keys[i] = malloc(lengths[i]);
+		memcpy(keys[i], buffer, lengths[i]);
+	}
+	benchmarkHash("identifiers", keys, lengths, HASH_TEST_KEYS, 20);
+
+	// Long text: words from the same list, separated by spaces and the odd newline
+	char* texts[16];
+	int textLengths[16];
+	srand(1);
+	for (int i = 0; i < 16; i++)
+	{
+		texts[i] = malloc(HASH_TEST_TEXT);
+		int length = 0;
+		while (length < HASH_TEST_TEXT - 16)
+		{
+			const char* word = hashTestWords[rand() % HASH_TEST_WORD_COUNT];
+			int wordLength = (int)strlen(word);
+			memcpy(texts[i] + length, word, wordLength);
+			length += wordLength;
+			texts[i][length++] = rand() % 10 == 0 ? '\n' : ' ';
+		}
+		textLengths[i] = length;
+	}
+	benchmarkHash("long text", texts, textLengths, 16, 5000);
+
+	for (int i = 0; i < HASH_TEST_KEYS; i++)
+	{
+		free(keys[i]);
+	}
+	free(keys);
+	free(lengths);
+	for (int i = 0; i < 16; i++)
+	{
+		free(texts[i]);
+	}
+
+	bool passed = checkDistribution("identifiers", identifierKey);
+	passed = checkDistribution("sequential", sequentialKey) && passed;
+	return passed;
+}
+#endif
@@ -3,10 +3,11 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "heap.h"
 #include "table.h"
 #include "value.h"
 
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#define OBJ_TYPE(value) HEADER_TYPE(AS_OBJ(value))
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
@@ -14,7 +15,10 @@
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_VIEW(value) isObjType(value, OBJ_VIEW)
+#define IS_STRING_LIKE(value) (IS_SHORT_STRING(value) || IS_STRING(value) || IS_ROPE(value) || IS_VIEW(value)) // Anything Lox code sees as a string
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
@@ -22,8 +26,14 @@
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_VIEW(value) ((ObjView*)AS_OBJ(value))
+
+// Variable-size objects are allocated and freed with their inline payload included
+#define STRING_SIZE(length) (sizeof(ObjString) + sizeof(char) * ((length) + 1))
+#define CLOSURE_SIZE(upvalueCount) (sizeof(ObjClosure) + sizeof(REF(ObjUpvalue)) * (upvalueCount))
 
 typedef enum
 {
@@ -33,25 +43,50 @@ typedef enum
 	OBJ_FUNCTION,
 	OBJ_INSTANCE,
 	OBJ_NATIVE,
+	OBJ_ROPE,
 	OBJ_STRING,
-	OBJ_UPVALUE
+	OBJ_UPVALUE,
+	OBJ_VIEW
 } ObjType;
 
+// The whole header is one word: the type in the low bits and the mark bit above them
+// There's no next pointer, the GC finds objects by walking the heap's pages instead
+#define OBJ_TYPE_MASK 0x0f
+#define OBJ_MARKED 0x10
+
+#define HEADER_TYPE(object) ((ObjType)((object)->header & OBJ_TYPE_MASK))
+#define IS_MARKED(object) (((object)->header & OBJ_MARKED) != 0)
+
 struct Obj
 {
-	ObjType type;
-	bool isMarked;
-	struct Obj* next;
+	uint64_t header;
 };
 
+// Methods that only read or write one field of this. Calls to them skip the call frame
+typedef enum
+{
+	ACCESSOR_NONE,
+	ACCESSOR_GETTER, // { return this.field; }
+	ACCESSOR_SETTER // (value) { this.field = value; }
+} AccessorKind;
+
 typedef struct
 {
 	Obj obj;
 	int arity;
 	int upvalueCount;
+	int localCount; // Most locals it has at once, so a call can check the stack has room
+	AccessorKind accessor;
+	uint8_t accessorField; // Constant holding the field's name
 
 	Chunk chunk;
 	ObjString* name;
+
+	// Set while a function from a mapped image hasn't been called yet. Its code is just OP_LOAD_FUNCTION until then, see cache.c
+	const uint8_t* image;
+	uint32_t imageFunction;
+	// Set while a function declared with -l hasn't been called yet. Same stub, see compiler.c
+	struct LazyFunction* lazy;
 } ObjFunction;
 
 typedef Value(*NativeFn)(int argCount, Value* args);
@@ -68,24 +103,46 @@ struct ObjString
 	// We can convert ObjString pointers to Obj pointers safely. Technically, we can convert a pointer to a struct to a pointer to that struct's first field.
 	Obj obj;
 	int length;
-	char* chars;
 	uint32_t hash;
+	bool isInterned; // Only interned strings are in vm.strings and can be used as table keys
+	char chars[]; // Flexible array member - the characters live inline after the header, in the same allocation
 };
 
+// A string built by repeated concatenation. Ropes share an append-only buffer, and each one is a prefix of it,
+// so appending to the newest rope only copies the new chars instead of the whole string
+typedef struct ObjRope
+{
+	Obj obj;
+	int length;
+	struct ObjRope* owner; // The rope that allocated the buffer (itself for the first one). Keeps the buffer alive
+	char* chars; // Owner only
+	int count; // Owner only. Chars written so far - a rope with length == count is the newest and can append in place
+	int capacity; // Owner only
+} ObjRope;
+
+// A substring that shares its parent's chars instead of copying them
+typedef struct
+{
+	Obj obj;
+	Obj* parent; // ObjString or rope owner - never another view, so chars are one hop away
+	int start;
+	int length;
+} ObjView;
+
 typedef	struct ObjUpvalue
 {
 	Obj obj;
 	Value* location;
 	Value closed;
-	struct ObjUpvalue* next;
+	REF(struct ObjUpvalue) next;
 } ObjUpvalue;
 
 typedef struct
 {
 	Obj obj;
 	ObjFunction* function;
-	ObjUpvalue** upvalues;
 	int upvalueCount; // Redundant since function stores the upvalue count, but helps with GC
+	REF(ObjUpvalue) upvalues[]; // Inline, like ObjString's chars
 } ObjClosure;
 
 typedef	struct
@@ -115,15 +172,66 @@ ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
+ObjRope* newRope(const char* a, int aLength, const char* b, int bLength);
+ObjRope* appendRope(ObjRope* rope, const char* chars, int length);
+bool stringsEqual(Value a, Value b);
+ObjString* allocateString(int length);
 ObjString* copyString(const char* chars, int length);
+Value copyStringValue(const char* chars, int length);
 ObjUpvalue* newUpvalue(Value* slot);
+ObjView* newView(Value parent, int start, int length);
 void printObject(Value value);
+#ifdef DEBUG_HASH_TEST
+bool testStringHash();
+#endif
 
 // Use a function to avoid evaluating the expression multiple times
 static inline bool isObjType(Value value, ObjType type)
 {
-	return IS_OBJ(value) && AS_OBJ(value)->type == type;
+	return IS_OBJ(value) && OBJ_TYPE(value) == type;
+}
+
+// Characters of any string value. Short strings are unpacked into buffer (SHORT_STRING_MAX chars)
+// Only heap strings are NUL-terminated, so always use length
+static inline const char* stringChars(Value value, char* buffer, int* length)
+{
+	if (IS_SHORT_STRING(value))
+	{
+		*length = shortStringChars(value, buffer);
+		return buffer;
+	}
+
+	switch (OBJ_TYPE(value))
+	{
+	case OBJ_ROPE:
+	{
+		ObjRope* rope = AS_ROPE(value);
+		*length = rope->length;
+		return rope->owner->chars;
+	}
+	case OBJ_VIEW:
+	{
+		ObjView* view = AS_VIEW(value);
+		*length = view->length;
+		if (HEADER_TYPE(view->parent) == OBJ_ROPE)
+			return ((ObjRope*)view->parent)->chars + view->start;
+		return ((ObjString*)view->parent)->chars + view->start;
+	}
+	default:
+	{
+		ObjString* string = AS_STRING(value);
+		*length = string->length;
+		return string->chars;
+	}
+	}
+}
+
+static inline int stringLength(Value value)
+{
+	char buffer[SHORT_STRING_MAX];
+	int length;
+	stringChars(value, buffer, &length);
+	return length;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,406 @@
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+typedef struct
+{
+	int offset;
+	int length;
+	uint8_t op; // Can differ from the chunk's byte once an instruction has been rewritten
+	bool wide; // Has an OP_WIDE in front. op is the instruction after it
+	int target; // Index of the instruction a jump lands on (the instruction count for the end of the chunk)
+	bool isTarget;
+	bool removed;
+} Instruction;
+
+typedef struct
+{
+	Chunk* chunk;
+	Instruction* instructions;
+	int count;
+} Optimizer;
+
+static bool isPlainJump(uint8_t op)
+{
+	return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE || op == OP_LOOP;
+}
+
+int readLong(const uint8_t* code)
+{
+	return (code[0] << 16) | (code[1] << 8) | code[2];
+}
+
+int instructionLength(Chunk* chunk, int offset)
+{
+	switch (chunk->code[offset])
+	{
+	case OP_CONSTANT_LONG:
+		return 4;
+	case OP_WIDE:
+	{
+		// A jump offset takes one more byte than usual and an index two more, plus the OP_WIDE itself
+		uint8_t op = chunk->code[offset + 1];
+		if (op == OP_CLOSURE)
+		{
+			ObjFunction* function = AS_FUNCTION(chunk->constants.values[readLong(chunk->code + offset + 2)]);
+			return 5 + function->upvalueCount * 4; // Upvalue indexes are three bytes too
+		}
+		return 1 + instructionLength(chunk, offset + 1) + (isPlainJump(op) ? 1 : 2);
+	}
+	case OP_CONSTANT:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_GET_SUPER:
+	case OP_CONCAT_N:
+	case OP_CALL:
+	case OP_CLASS:
+	case OP_METHOD:
+	case OP_INLINE_RETURN:
+		return 2;
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_TRUE:
+	case OP_LOOP:
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+	case OP_ADD_LOCAL:
+	case OP_INC_LOCAL:
+		return 3;
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_NOT_LESS_CONST:
+	case OP_JUMP_IF_NOT_GREATER_CONST:
+		return 5; // The two operands, then the jump
+	case OP_INLINE_GUARD:
+		return 5; // The argument count and the inlined function, then the jump
+	case OP_CLOSURE:
+	{
+		ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+		return 2 + function->upvalueCount * 2; // Each upvalue is an isLocal byte and an index byte
+	}
+	default:
+		return 1;
+	}
+}
+
+static bool isForwardJump(uint8_t op)
+{
+	return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE;
+}
+
+// Compare-and-branch jumps depend on their operands, and OP_INLINE_GUARD only jumps to where its call returns
+// Nothing threads through either
+static bool isJump(uint8_t op)
+{
+	return isForwardJump(op) || op == OP_LOOP || op == OP_INLINE_GUARD || op == OP_JUMP_IF_NOT_LESS ||
+		op == OP_JUMP_IF_NOT_GREATER || op == OP_JUMP_IF_NOT_LESS_CONST || op == OP_JUMP_IF_NOT_GREATER_CONST;
+}
+
+// Index of the first live instruction at or after index
+static int live(Optimizer* optimizer, int index)
+{
+	while (index < optimizer->count && optimizer->instructions[index].removed)
+		index++;
+	return index;
+}
+
+static int next(Optimizer* optimizer, int index)
+{
+	return live(optimizer, index + 1);
+}
+
+static uint8_t opAt(Optimizer* optimizer, int index)
+{
+	index = live(optimizer, index);
+	if (index >= optimizer->count)
+		return OP_RETURN; // Nothing runs past the end of a chunk
+	return optimizer->instructions[index].op;
+}
+
+static int indexOperand(Optimizer* optimizer, int index)
+{
+	Instruction* instruction = &optimizer->instructions[index];
+	uint8_t* code = optimizer->chunk->code + instruction->offset;
+	return instruction->wide ? readLong(code + 2) : code[1];
+}
+
+// Whether two variable instructions name the same variable. Globals are looked up by name, and each use has its own constant
+static bool sameVariable(Optimizer* optimizer, int a, int b)
+{
+	int operandA = indexOperand(optimizer, a);
+	int operandB = indexOperand(optimizer, b);
+	if (optimizer->instructions[a].op != OP_SET_GLOBAL)
+		return operandA == operandB;
+
+	Value* constants = optimizer->chunk->constants.values;
+	return valuesEqual(constants[operandA], constants[operandB]);
+}
+
+static void removeInstruction(Optimizer* optimizer, int index)
+{
+	optimizer->instructions[index].removed = true;
+
+	// Jumps to it now land on the next instruction
+	int following = next(optimizer, index);
+	if (optimizer->instructions[index].isTarget && following < optimizer->count)
+		optimizer->instructions[following].isTarget = true;
+}
+
+// A removed instruction did nothing, so jumps to it can land on whatever comes next
+static void markTargets(Optimizer* optimizer)
+{
+	for (int i = 0; i < optimizer->count; i++)
+	{
+		optimizer->instructions[i].isTarget = false;
+	}
+
+	for (int i = 0; i < optimizer->count; i++)
+	{
+		Instruction* instruction = &optimizer->instructions[i];
+		if (instruction->removed || !isJump(instruction->op))
+			continue;
+
+		instruction->target = live(optimizer, instruction->target);
+		if (instruction->target < optimizer->count)
+			optimizer->instructions[instruction->target].isTarget = true;
+	}
+}
+
+// A jump that lands on an OP_JUMP can go straight to where that one goes
+// Conditional jumps don't pop, so one landing on the same kind of conditional jump would take it too
+static bool threadJumps(Optimizer* optimizer)
+{
+	bool changed = false;
+	for (int i = 0; i < optimizer->count; i++)
+	{
+		Instruction* instruction = &optimizer->instructions[i];
+		if (instruction->removed || !isForwardJump(instruction->op))
+			continue;
+
+		int target = live(optimizer, instruction->target);
+		while (target < optimizer->count)
+		{
+			uint8_t op = optimizer->instructions[target].op;
+			if (op != OP_JUMP && op != instruction->op)
+				break;
+			target = live(optimizer, optimizer->instructions[target].target); // Forward jumps only, so this ends
+		}
+
+		// Code only shrinks from here, so a jump that fits now still fits afterwards
+		int end = instruction->offset + instruction->length;
+		int targetOffset = target < optimizer->count ? optimizer->instructions[target].offset : optimizer->chunk->count;
+		if (targetOffset - end > (instruction->wide ? WIDE_MAX : UINT16_MAX))
+			continue;
+
+		if (target == next(optimizer, i))
+		{
+			// Jumping to the next instruction is the same as not jumping
+			removeInstruction(optimizer, i);
+			changed = true;
+		}
+		else if (target != instruction->target)
+		{
+			instruction->target = target;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+// Nothing after an unconditional jump or a return runs until something jumps there
+static bool removeUnreachable(Optimizer* optimizer)
+{
+	bool changed = false;
+	for (int i = 0; i < optimizer->count; i++)
+	{
+		uint8_t op = optimizer->instructions[i].op;
+		if (optimizer->instructions[i].removed || (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN))
+			continue;
+
+		for (int j = next(optimizer, i); j < optimizer->count && !optimizer->instructions[j].isTarget; j = next(optimizer, j))
+		{
+			removeInstruction(optimizer, j);
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+static bool isPureLoad(uint8_t op)
+{
+	return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE || op == OP_GET_LOCAL || op == OP_GET_UPVALUE;
+}
+
+// The instruction that reads back what op stores, or -1 if op isn't a store
+static int getForSet(uint8_t op)
+{
+	switch (op)
+	{
+	case OP_SET_LOCAL: return OP_GET_LOCAL;
+	case OP_SET_UPVALUE: return OP_GET_UPVALUE;
+	case OP_SET_GLOBAL: return OP_GET_GLOBAL;
+	default: return -1;
+	}
+}
+
+// Patterns are only rewritten when nothing jumps into the middle of them
+static bool simplify(Optimizer* optimizer)
+{
+	bool changed = false;
+	for (int i = live(optimizer, 0); i < optimizer->count; i = next(optimizer, i))
+	{
+		Instruction* instruction = &optimizer->instructions[i];
+		int j = next(optimizer, i);
+		if (j >= optimizer->count || optimizer->instructions[j].isTarget)
+			continue;
+		Instruction* second = &optimizer->instructions[j];
+
+		// Pushing something just to pop it again
+		if (isPureLoad(instruction->op) && second->op == OP_POP)
+		{
+			removeInstruction(optimizer, i);
+			removeInstruction(optimizer, j);
+			changed = true;
+			continue;
+		}
+
+		// OP_NOT, OP_JUMP_IF_FALSE -> OP_JUMP_IF_TRUE, as long as the (now un-negated) condition is popped either way
+		if (instruction->op == OP_NOT && (second->op == OP_JUMP_IF_FALSE || second->op == OP_JUMP_IF_TRUE) &&
+			opAt(optimizer, next(optimizer, j)) == OP_POP && opAt(optimizer, second->target) == OP_POP)
+		{
+			second->op = second->op == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE;
+			removeInstruction(optimizer, i);
+			changed = true;
+			continue;
+		}
+
+		// x = value; then reading x straight back: the assignment already left the value on the stack
+		int k = next(optimizer, j);
+		int getOp = getForSet(instruction->op);
+		if (getOp != -1 && second->op == OP_POP && k < optimizer->count && !optimizer->instructions[k].isTarget &&
+			opAt(optimizer, k) == getOp && sameVariable(optimizer, i, k))
+		{
+			removeInstruction(optimizer, j);
+			removeInstruction(optimizer, k);
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+// Moves every live instruction down over the removed ones and re-encodes the jumps
+static void compact(Optimizer* optimizer)
+{
+	Chunk* chunk = optimizer->chunk;
+	int* newOffsets = ALLOCATE(int, optimizer->count + 1);
+	LineTable lines;
+	initLineTable(&lines);
+
+	int newCount = 0;
+	for (int i = 0; i < optimizer->count; i++)
+	{
+		newOffsets[i] = newCount;
+		if (!optimizer->instructions[i].removed)
+			newCount += optimizer->instructions[i].length;
+	}
+	newOffsets[optimizer->count] = newCount;
+
+	// Instructions only move towards the start, so copying in order never overwrites one that hasn't moved yet
+	for (int i = 0; i < optimizer->count; i++)
+	{
+		Instruction* instruction = &optimizer->instructions[i];
+		if (instruction->removed)
+			continue;
+
+		int offset = newOffsets[i];
+		memmove(chunk->code + offset, chunk->code + instruction->offset, instruction->length);
+		writeLine(&lines, offset, getLine(&chunk->lines, instruction->offset));
+		chunk->code[offset + instruction->wide] = instruction->op;
+
+		if (isJump(instruction->op))
+		{
+			int target = newOffsets[live(optimizer, instruction->target)];
+			int end = offset + instruction->length;
+			int jump = instruction->op == OP_LOOP ? end - target : target - end;
+			if (instruction->wide)
+				chunk->code[end - 3] = (jump >> 16) & 0xff; // A jump's offset is always its last bytes
+			chunk->code[end - 2] = (jump >> 8) & 0xff;
+			chunk->code[end - 1] = jump & 0xff;
+		}
+	}
+
+	chunk->count = newCount;
+	freeLineTable(&chunk->lines);
+	chunk->lines = lines;
+	FREE_ARRAY(int, newOffsets, optimizer->count + 1);
+}
+
+void optimizeChunk(Chunk* chunk)
+{
+	Optimizer optimizer;
+	optimizer.chunk = chunk;
+	optimizer.count = 0;
+
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+	{
+		optimizer.count++;
+	}
+
+	optimizer.instructions = ALLOCATE(Instruction, optimizer.count);
+	int* indexAt = ALLOCATE(int, chunk->count + 1); // Instruction index for each instruction's offset
+	indexAt[chunk->count] = optimizer.count;
+
+	int offset = 0;
+	for (int i = 0; i < optimizer.count; i++)
+	{
+		Instruction* instruction = &optimizer.instructions[i];
+		instruction->offset = offset;
+		instruction->length = instructionLength(chunk, offset);
+		instruction->wide = chunk->code[offset] == OP_WIDE;
+		instruction->op = chunk->code[offset + instruction->wide];
+		instruction->removed = false;
+		indexAt[offset] = i;
+		offset += instruction->length;
+	}
+
+	for (int i = 0; i < optimizer.count; i++)
+	{
+		Instruction* instruction = &optimizer.instructions[i];
+		if (!isJump(instruction->op))
+			continue;
+
+		int end = instruction->offset + instruction->length;
+		int jump = instruction->wide ? readLong(chunk->code + end - 3) : (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+		int target = instruction->op == OP_LOOP ? end - jump : end + jump;
+		instruction->target = indexAt[target];
+	}
+	FREE_ARRAY(int, indexAt, chunk->count + 1);
+
+	// Each rewrite can expose another, so keep going until nothing changes
+	bool changed;
+	do
+	{
+		markTargets(&optimizer);
+		changed = threadJumps(&optimizer);
+		markTargets(&optimizer);
+		changed |= removeUnreachable(&optimizer);
+		markTargets(&optimizer);
+		changed |= simplify(&optimizer);
+	}
+	while (changed);
+
+	compact(&optimizer);
+	FREE_ARRAY(Instruction, optimizer.instructions, optimizer.count);
+}
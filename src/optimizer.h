@@ -0,0 +1,15 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// Peephole pass over a finished chunk. Only ever shrinks the code
+void optimizeChunk(Chunk* chunk);
+
+// Bytes taken by the instruction at offset, operands included
+int instructionLength(Chunk* chunk, int offset);
+
+// Three-byte operand, as taken by OP_CONSTANT_LONG and anything after OP_WIDE
+int readLong(const uint8_t* code);
+
+#endif
@@ -4,19 +4,13 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct
-{
-	const char* start;
-	const char* current;
-	int line;
-} Scanner;
-
 Scanner scanner;
 
-void initScanner(const char* source)
+void initScanner(const char* source, size_t length)
 {
 	scanner.start = source;
 	scanner.current = source;
+	scanner.end = source + length;
 	scanner.line = 1;
 }
 
@@ -34,7 +28,7 @@ static bool	isDigit(char c)
 
 static bool	isAtEnd()
 {
-	return *scanner.current == '\0';
+	return scanner.current == scanner.end;
 }
 
 static char advance()
@@ -43,14 +37,16 @@ static char advance()
 	return scanner.current[-1];
 }
 
+// '\0' past the end, which nothing matches
 static char peek()
 {
+	if (isAtEnd()) return '\0';
 	return *scanner.current;
 }
 
 static char peekNext()
 {
-	if (isAtEnd()) return '\0';
+	if (scanner.end - scanner.current < 2) return '\0';
 	return scanner.current[1];
 }
 
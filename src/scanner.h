@@ -32,7 +32,18 @@ typedef struct
 	int	line;
 } Token;
 
-void initScanner(const char* source);
+typedef struct
+{
+	const char* start;
+	const char* current;
+	const char* end; // Just past the last char. The source doesn't need a '\0', so a mapped file can be scanned in place
+	int line;
+} Scanner;
+
+// Exposed so the compiler can save its place and scan part of the source again
+extern Scanner scanner;
+
+void initScanner(const char* source, size_t length);
 Token scanToken();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,900 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "vm.h"
+
+// Bump whenever this format or the meaning of any opcode changes. Snapshots hold bytecode too
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAGIC "loxs"
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+#define NO_OBJECT UINT32_MAX
+
+typedef enum
+{
+	SNAPSHOT_NIL,
+	SNAPSHOT_BOOL,
+	SNAPSHOT_NUMBER,
+	SNAPSHOT_SHORT_STRING,
+	SNAPSHOT_OBJECT
+} ValueTag;
+
+/*
+	Everything is little-endian, whatever the machine
+	Header: magic, version, opcode count, object count, global count, payload length, payload hash
+	Payload: every object, then the globals (name, value)
+	Objects are numbered by type: strings, functions, natives, classes, upvalues, closures, instances, bound methods
+	That way everything an object needs to be created is numbered before it, and the rest is filled in by a second pass
+	References are object numbers, and values are a ValueTag and what it needs
+	Ropes and views are saved as plain strings, and natives by their index in vm.c's list
+*/
+typedef struct
+{
+	uint8_t* bytes;
+	int count;
+	int capacity;
+} Writer;
+
+typedef struct
+{
+	Obj** found; // Everything reachable, in the order it was found
+	uint32_t* ids; // Number of each found object
+	int count;
+	int capacity;
+
+	int* slots; // Open addressing over found, so each object is only added once
+	int slotCapacity;
+
+	bool failed;
+} Snapshot;
+
+typedef struct
+{
+	const uint8_t* current;
+	const uint8_t* end;
+	bool linking; // Second pass: references can be filled in now that every object exists
+	bool failed;
+} Reader;
+
+// Objects made so far by a restore, kept alive until the globals hold them
+static Obj** restored = NULL;
+static uint32_t restoredCount = 0;
+
+static uint64_t hashBytes(const void* bytes, size_t length)
+{
+	// FNV-1a. Only has to catch damaged files, not resist anyone
+	const uint8_t* byte = (const uint8_t*)bytes;
+	uint64_t hash = FNV_OFFSET;
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= byte[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static void writeBytes(Writer* writer, const void* bytes, int length)
+{
+	if (length == 0)
+		return;
+
+	if (writer->capacity < writer->count + length)
+	{
+		int oldCapacity = writer->capacity;
+		while (writer->capacity < writer->count + length)
+			writer->capacity = GROW_CAPACITY(writer->capacity);
+		writer->bytes = GROW_ARRAY(uint8_t, writer->bytes, oldCapacity, writer->capacity);
+	}
+
+	memcpy(writer->bytes + writer->count, bytes, length);
+	writer->count += length;
+}
+
+static void writeU8(Writer* writer, uint8_t value)
+{
+	writeBytes(writer, &value, 1);
+}
+
+static void writeU32(Writer* writer, uint32_t value)
+{
+	uint8_t bytes[4];
+	for (int i = 0; i < 4; i++)
+		bytes[i] = (uint8_t)(value >> (8 * i));
+	writeBytes(writer, bytes, 4);
+}
+
+static void writeU64(Writer* writer, uint64_t value)
+{
+	writeU32(writer, (uint32_t)value);
+	writeU32(writer, (uint32_t)(value >> 32));
+}
+
+// Strings, ropes and views are all saved as strings, so they're numbered together
+static int typeRank(Obj* object)
+{
+	switch (HEADER_TYPE(object))
+	{
+	case OBJ_STRING:
+	case OBJ_ROPE:
+	case OBJ_VIEW: return 0;
+	case OBJ_FUNCTION: return 1;
+	case OBJ_NATIVE: return 2;
+	case OBJ_CLASS: return 3;
+	case OBJ_UPVALUE: return 4;
+	case OBJ_CLOSURE: return 5;
+	case OBJ_INSTANCE: return 6;
+	case OBJ_BOUND_METHOD: return 7;
+	}
+	return 0;
+}
+
+#define RANK_COUNT 8
+
+static uint32_t hashPointer(Obj* object)
+{
+	uint64_t bits = (uint64_t)(uintptr_t)object >> 3; // Objects are at least 8 aligned
+	return (uint32_t)((bits * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+// Index of object in found, or of the empty slot it would go in, negated and minus one
+static int findObject(Snapshot* snapshot, Obj* object)
+{
+	uint32_t index = hashPointer(object) & (snapshot->slotCapacity - 1);
+	for (;;)
+	{
+		int slot = snapshot->slots[index];
+		if (slot == -1)
+			return -(int)index - 1;
+		if (snapshot->found[slot] == object)
+			return slot;
+		index = (index + 1) & (snapshot->slotCapacity - 1);
+	}
+}
+
+static void growSlots(Snapshot* snapshot)
+{
+	FREE_ARRAY(int, snapshot->slots, snapshot->slotCapacity);
+	snapshot->slotCapacity = GROW_CAPACITY(snapshot->slotCapacity);
+	snapshot->slots = ALLOCATE(int, snapshot->slotCapacity);
+	for (int i = 0; i < snapshot->slotCapacity; i++)
+		snapshot->slots[i] = -1;
+
+	for (int i = 0; i < snapshot->count; i++)
+	{
+		int empty = -findObject(snapshot, snapshot->found[i]) - 1;
+		snapshot->slots[empty] = i;
+	}
+}
+
+static void addObject(Snapshot* snapshot, Obj* object)
+{
+	if (object == NULL)
+		return;
+
+	if ((snapshot->count + 1) * 4 > snapshot->slotCapacity * 3)
+		growSlots(snapshot);
+
+	int slot = findObject(snapshot, object);
+	if (slot >= 0)
+		return;
+
+	if (snapshot->capacity < snapshot->count + 1)
+	{
+		int oldCapacity = snapshot->capacity;
+		snapshot->capacity = GROW_CAPACITY(oldCapacity);
+		snapshot->found = GROW_ARRAY(Obj*, snapshot->found, oldCapacity, snapshot->capacity);
+	}
+
+	snapshot->slots[-slot - 1] = snapshot->count;
+	snapshot->found[snapshot->count++] = object;
+}
+
+static void addValue(Snapshot* snapshot, Value value)
+{
+	if (IS_OBJ(value))
+		addObject(snapshot, AS_OBJ(value));
+}
+
+static void addTable(Snapshot* snapshot, Table* table)
+{
+	for (int i = 0; i < table->capacity; i++)
+	{
+		Entry* entry = &table->entries[i];
+		if (entry->key != NULL_REF)
+		{
+			addObject(snapshot, (Obj*)FROM_REF(ObjString, entry->key));
+			addValue(snapshot, entry->value);
+		}
+	}
+}
+
+// Adds everything object refers to
+static void addReferences(Snapshot* snapshot, Obj* object)
+{
+	switch (HEADER_TYPE(object))
+	{
+	case OBJ_BOUND_METHOD:
+	{
+		ObjBoundMethod* bound = (ObjBoundMethod*)object;
+		addValue(snapshot, bound->receiver);
+		addObject(snapshot, (Obj*)bound->method);
+		break;
+	}
+	case OBJ_CLASS:
+	{
+		ObjClass* klass = (ObjClass*)object;
+		addObject(snapshot, (Obj*)klass->name);
+		addTable(snapshot, &klass->methods);
+		break;
+	}
+	case OBJ_CLOSURE:
+	{
+		ObjClosure* closure = (ObjClosure*)object;
+		addObject(snapshot, (Obj*)closure->function);
+		for (int i = 0; i < closure->upvalueCount; i++)
+			addObject(snapshot, (Obj*)FROM_REF(ObjUpvalue, closure->upvalues[i]));
+		break;
+	}
+	case OBJ_FUNCTION:
+	{
+		ObjFunction* function = (ObjFunction*)object;
+		// Still a stub. It's reachable, so the GC leaves it alone meanwhile
+		if (function->image != NULL)
+			loadImageFunction(function);
+		else if (function->lazy != NULL && !compileLazyFunction(function))
+			snapshot->failed = true;
+		addObject(snapshot, (Obj*)function->name);
+		for (int i = 0; i < function->chunk.constants.count; i++)
+			addValue(snapshot, function->chunk.constants.values[i]);
+		break;
+	}
+	case OBJ_INSTANCE:
+	{
+		ObjInstance* instance = (ObjInstance*)object;
+		addObject(snapshot, (Obj*)instance->klass);
+		addTable(snapshot, &instance->fields);
+		break;
+	}
+	case OBJ_UPVALUE:
+	{
+		ObjUpvalue* upvalue = (ObjUpvalue*)object;
+		if (upvalue->location != &upvalue->closed)
+			snapshot->failed = true; // Still open, so something is running
+		addValue(snapshot, upvalue->closed);
+		break;
+	}
+	case OBJ_NATIVE:
+		if (nativeIndex(((ObjNative*)object)->function) == -1)
+			snapshot->failed = true;
+		break;
+	case OBJ_ROPE:
+	case OBJ_STRING:
+	case OBJ_VIEW:
+		break; // Saved flat
+	}
+}
+
+static uint32_t objectId(Snapshot* snapshot, Obj* object)
+{
+	return object == NULL ? NO_OBJECT : snapshot->ids[findObject(snapshot, object)];
+}
+
+static void writeValue(Writer* writer, Snapshot* snapshot, Value value)
+{
+	if (IS_NIL(value))
+	{
+		writeU8(writer, SNAPSHOT_NIL);
+	}
+	else if (IS_BOOL(value))
+	{
+		writeU8(writer, SNAPSHOT_BOOL);
+		writeU8(writer, AS_BOOL(value) ? 1 : 0);
+	}
+	else if (IS_NUMBER(value))
+	{
+		double number = AS_NUMBER(value);
+		uint64_t bits;
+		memcpy(&bits, &number, sizeof(bits));
+		writeU8(writer, SNAPSHOT_NUMBER);
+		writeU64(writer, bits);
+	}
+	else if (IS_SHORT_STRING(value))
+	{
+		writeU8(writer, SNAPSHOT_SHORT_STRING);
+		writeU64(writer, SHORT_STRING_PAYLOAD(value));
+	}
+	else
+	{
+		writeU8(writer, SNAPSHOT_OBJECT);
+		writeU32(writer, objectId(snapshot, AS_OBJ(value)));
+	}
+}
+
+static void writeTable(Writer* writer, Snapshot* snapshot, Table* table)
+{
+	uint32_t count = 0;
+	for (int i = 0; i < table->capacity; i++)
+	{
+		if (table->entries[i].key != NULL_REF)
+			count++;
+	}
+
+	writeU32(writer, count);
+	for (int i = 0; i < table->capacity; i++)
+	{
+		Entry* entry = &table->entries[i];
+		if (entry->key != NULL_REF)
+		{
+			writeU32(writer, objectId(snapshot, (Obj*)FROM_REF(ObjString, entry->key)));
+			writeValue(writer, snapshot, entry->value);
+		}
+	}
+}
+
+static void writeObject(Writer* writer, Snapshot* snapshot, Obj* object)
+{
+	ObjType type = HEADER_TYPE(object);
+	writeU8(writer, (uint8_t)(typeRank(object) == 0 ? OBJ_STRING : type));
+
+	switch (type)
+	{
+	case OBJ_STRING:
+	case OBJ_ROPE:
+	case OBJ_VIEW:
+	{
+		char buffer[SHORT_STRING_MAX];
+		int length;
+		const char* chars = stringChars(OBJ_VAL(object), buffer, &length);
+		writeU8(writer, type == OBJ_STRING && ((ObjString*)object)->isInterned ? 1 : 0);
+		writeU32(writer, length);
+		writeBytes(writer, chars, length);
+		break;
+	}
+	case OBJ_FUNCTION:
+	{
+		ObjFunction* function = (ObjFunction*)object;
+		Chunk* chunk = &function->chunk;
+		writeU32(writer, function->arity);
+		writeU32(writer, function->upvalueCount);
+		writeU32(writer, function->localCount);
+		writeU8(writer, (uint8_t)function->accessor);
+		writeU8(writer, function->accessorField);
+		writeU32(writer, objectId(snapshot, (Obj*)function->name));
+
+		writeU32(writer, chunk->count);
+		writeBytes(writer, chunk->code, chunk->count);
+		writeU32(writer, chunk->lines.count);
+		for (int i = 0; i < chunk->lines.count; i++)
+		{
+			writeU32(writer, chunk->lines.starts[i].offset);
+			writeU32(writer, chunk->lines.starts[i].line);
+		}
+		writeU32(writer, chunk->constants.count);
+		for (int i = 0; i < chunk->constants.count; i++)
+			writeValue(writer, snapshot, chunk->constants.values[i]);
+		break;
+	}
+	case OBJ_NATIVE:
+		writeU32(writer, (uint32_t)nativeIndex(((ObjNative*)object)->function));
+		break;
+	case OBJ_CLASS:
+	{
+		ObjClass* klass = (ObjClass*)object;
+		writeU32(writer, objectId(snapshot, (Obj*)klass->name));
+		writeTable(writer, snapshot, &klass->methods);
+		break;
+	}
+	case OBJ_UPVALUE:
+		writeValue(writer, snapshot, ((ObjUpvalue*)object)->closed);
+		break;
+	case OBJ_CLOSURE:
+	{
+		ObjClosure* closure = (ObjClosure*)object;
+		writeU32(writer, objectId(snapshot, (Obj*)closure->function));
+		writeU32(writer, closure->upvalueCount);
+		for (int i = 0; i < closure->upvalueCount; i++)
+			writeU32(writer, objectId(snapshot, (Obj*)FROM_REF(ObjUpvalue, closure->upvalues[i])));
+		break;
+	}
+	case OBJ_INSTANCE:
+	{
+		ObjInstance* instance = (ObjInstance*)object;
+		writeU32(writer, objectId(snapshot, (Obj*)instance->klass));
+		writeTable(writer, snapshot, &instance->fields);
+		break;
+	}
+	case OBJ_BOUND_METHOD:
+	{
+		ObjBoundMethod* bound = (ObjBoundMethod*)object;
+		writeValue(writer, snapshot, bound->receiver);
+		writeU32(writer, objectId(snapshot, (Obj*)bound->method));
+		break;
+	}
+	}
+}
+
+bool saveSnapshot(const char* path)
+{
+	Snapshot snapshot;
+	snapshot.found = NULL;
+	snapshot.ids = NULL;
+	snapshot.count = 0;
+	snapshot.capacity = 0;
+	snapshot.slots = NULL;
+	snapshot.slotCapacity = 0;
+	snapshot.failed = vm.frameCount != 0 || vm.openUpvalues != NULL;
+
+	// Walking the list as it grows finds everything reachable, like the GC's gray stack does
+	addTable(&snapshot, &vm.globals);
+	for (int i = 0; i < snapshot.count && !snapshot.failed; i++)
+		addReferences(&snapshot, snapshot.found[i]);
+
+	// Number the objects by type, keeping the order they were found in within each type
+	uint32_t next[RANK_COUNT] = { 0 };
+	for (int i = 0; i < snapshot.count; i++)
+		next[typeRank(snapshot.found[i])]++;
+	uint32_t start = 0;
+	for (int rank = 0; rank < RANK_COUNT; rank++)
+	{
+		uint32_t count = next[rank];
+		next[rank] = start;
+		start += count;
+	}
+
+	snapshot.ids = ALLOCATE(uint32_t, snapshot.count);
+	Obj** byId = ALLOCATE(Obj*, snapshot.count);
+	for (int i = 0; i < snapshot.count; i++)
+	{
+		uint32_t id = next[typeRank(snapshot.found[i])]++;
+		snapshot.ids[i] = id;
+		byId[id] = snapshot.found[i];
+	}
+
+	Writer payload = { NULL, 0, 0 };
+	uint32_t globalCount = 0;
+	if (!snapshot.failed)
+	{
+		for (int i = 0; i < snapshot.count; i++)
+			writeObject(&payload, &snapshot, byId[i]);
+
+		for (int i = 0; i < vm.globals.capacity; i++)
+		{
+			Entry* entry = &vm.globals.entries[i];
+			if (entry->key == NULL_REF)
+				continue;
+			writeU32(&payload, objectId(&snapshot, (Obj*)FROM_REF(ObjString, entry->key)));
+			writeValue(&payload, &snapshot, entry->value);
+			globalCount++;
+		}
+	}
+
+	Writer header = { NULL, 0, 0 };
+	writeBytes(&header, SNAPSHOT_MAGIC, 4);
+	writeU32(&header, SNAPSHOT_VERSION);
+	writeU32(&header, OP_WIDE + 1);
+	writeU32(&header, (uint32_t)snapshot.count);
+	writeU32(&header, globalCount);
+	writeU64(&header, payload.count);
+	writeU64(&header, hashBytes(payload.bytes, payload.count));
+
+	bool saved = false;
+	FILE* file = snapshot.failed ? NULL : fopen(path, "wb");
+	if (file != NULL)
+	{
+		saved = fwrite(header.bytes, 1, header.count, file) == (size_t)header.count &&
+			fwrite(payload.bytes, 1, payload.count, file) == (size_t)payload.count;
+		saved = fclose(file) == 0 && saved;
+	}
+
+	FREE_ARRAY(uint8_t, header.bytes, header.capacity);
+	FREE_ARRAY(uint8_t, payload.bytes, payload.capacity);
+	FREE_ARRAY(Obj*, byId, snapshot.count);
+	FREE_ARRAY(uint32_t, snapshot.ids, snapshot.count);
+	FREE_ARRAY(int, snapshot.slots, snapshot.slotCapacity);
+	FREE_ARRAY(Obj*, snapshot.found, snapshot.capacity);
+	return saved;
+}
+
+static const uint8_t* readBytes(Reader* reader, size_t length)
+{
+	if (reader->failed || (size_t)(reader->end - reader->current) < length)
+	{
+		reader->failed = true;
+		return NULL;
+	}
+
+	const uint8_t* bytes = reader->current;
+	reader->current += length;
+	return bytes;
+}
+
+static uint8_t readU8(Reader* reader)
+{
+	const uint8_t* bytes = readBytes(reader, 1);
+	return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t readU32(Reader* reader)
+{
+	const uint8_t* bytes = readBytes(reader, 4);
+	if (bytes == NULL)
+		return 0;
+
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++)
+		value |= (uint32_t)bytes[i] << (8 * i);
+	return value;
+}
+
+static uint64_t readU64(Reader* reader)
+{
+	uint64_t low = readU32(reader);
+	return low | ((uint64_t)readU32(reader) << 32);
+}
+
+// Reads a count and makes sure there's at least minSize bytes for each of them, so a bad count can't make a huge allocation
+static uint32_t readCount(Reader* reader, uint32_t max, size_t minSize)
+{
+	uint32_t count = readU32(reader);
+	if (count > max || (size_t)(reader->end - reader->current) / minSize < count)
+	{
+		reader->failed = true;
+		return 0;
+	}
+	return count;
+}
+
+// The object a reference names, if it's been made and has the right type. Null for NO_OBJECT when that's allowed
+static Obj* readReference(Reader* reader, ObjType type, bool optional)
+{
+	uint32_t id = readU32(reader);
+	if (id == NO_OBJECT && optional)
+		return NULL;
+
+	Obj* object = id < restoredCount ? restored[id] : NULL;
+	if (object == NULL || HEADER_TYPE(object) != type)
+	{
+		reader->failed = true;
+		return NULL;
+	}
+	return object;
+}
+
+// Only the second pass can point at any object, so the first just skips over values
+static Value readValue(Reader* reader)
+{
+	switch (readU8(reader))
+	{
+	case SNAPSHOT_NIL: return NIL_VAL;
+	case SNAPSHOT_BOOL: return BOOL_VAL(readU8(reader) != 0);
+	case SNAPSHOT_NUMBER:
+	{
+		uint64_t bits = readU64(reader);
+		double number;
+		memcpy(&number, &bits, sizeof(number));
+		return NUMBER_VAL(number);
+	}
+	case SNAPSHOT_SHORT_STRING:
+	{
+		// Rebuilt from its chars, so stray bits can't make two equal strings compare unequal
+		uint64_t payload = readU64(reader);
+		int length = (int)(payload >> 40);
+		if (length > SHORT_STRING_MAX)
+			break;
+		char chars[SHORT_STRING_MAX];
+		for (int i = 0; i < length; i++)
+			chars[i] = (char)(payload >> (8 * i));
+		Value value = makeShortString(chars, length);
+		if (SHORT_STRING_PAYLOAD(value) != payload)
+			break;
+		return value;
+	}
+	case SNAPSHOT_OBJECT:
+	{
+		uint32_t id = readU32(reader);
+		if (id >= restoredCount)
+			break;
+		if (!reader->linking)
+			return NIL_VAL;
+		return OBJ_VAL(restored[id]);
+	}
+	}
+
+	reader->failed = true;
+	return NIL_VAL;
+}
+
+static ObjString* readKey(Reader* reader)
+{
+	ObjString* key = (ObjString*)readReference(reader, OBJ_STRING, false);
+	if (key != NULL && !key->isInterned)
+	{
+		reader->failed = true; // Tables only work with interned keys
+		return NULL;
+	}
+	return key;
+}
+
+static void readTable(Reader* reader, Table* table)
+{
+	uint32_t count = readCount(reader, INT32_MAX, 5);
+	for (uint32_t i = 0; i < count && !reader->failed; i++)
+	{
+		ObjString* key = reader->linking ? readKey(reader) : (readU32(reader), NULL);
+		Value value = readValue(reader);
+		if (reader->linking && !reader->failed)
+			tableSet(table, key, value);
+	}
+}
+
+static void readFunction(Reader* reader, uint32_t id)
+{
+	uint32_t arity = readU32(reader);
+	uint32_t upvalueCount = readU32(reader);
+	uint32_t localCount = readU32(reader);
+	AccessorKind accessor = (AccessorKind)readU8(reader);
+	uint8_t accessorField = readU8(reader);
+	ObjString* name = (ObjString*)readReference(reader, OBJ_STRING, true);
+	uint32_t codeCount = readCount(reader, INT32_MAX, 1);
+	const uint8_t* code = readBytes(reader, codeCount);
+	uint32_t lineCount = readCount(reader, codeCount, 8);
+	const uint8_t* lines = readBytes(reader, (size_t)lineCount * 8);
+	if (arity > UINT8_MAX || upvalueCount > UINT16_COUNT || localCount > UINT16_COUNT || accessor > ACCESSOR_SETTER || codeCount == 0)
+		reader->failed = true;
+	if (reader->failed)
+		return;
+
+	if (!reader->linking)
+	{
+		ObjFunction* function = newFunction();
+		restored[id] = (Obj*)function; // Rooted from here on
+		function->arity = (int)arity;
+		function->upvalueCount = (int)upvalueCount;
+		function->localCount = (int)localCount;
+		function->accessor = accessor;
+		function->accessorField = accessorField;
+		function->name = name;
+
+		Chunk* chunk = &function->chunk;
+		chunk->code = ALLOCATE(uint8_t, codeCount);
+		memcpy(chunk->code, code, codeCount);
+		chunk->count = chunk->capacity = (int)codeCount;
+
+		Reader lineReader = { lines, lines + (size_t)lineCount * 8, false, false };
+		for (uint32_t i = 0; i < lineCount; i++)
+		{
+			int offset = (int)readU32(&lineReader);
+			int line = (int)readU32(&lineReader);
+			if (offset < 0 || offset >= chunk->count || (chunk->lines.count > 0 && offset <= chunk->lines.starts[chunk->lines.count - 1].offset))
+				reader->failed = true;
+			else
+				writeLine(&chunk->lines, offset, line);
+		}
+	}
+
+	ObjFunction* function = (ObjFunction*)restored[id];
+	uint32_t constantCount = readCount(reader, WIDE_MAX + 1, 1);
+	for (uint32_t i = 0; i < constantCount && !reader->failed; i++)
+	{
+		Value value = readValue(reader);
+		if (reader->linking && !reader->failed)
+			addConstant(&function->chunk, value);
+	}
+
+	if (reader->linking && !reader->failed)
+	{
+		// Accessors are run straight from the field's name
+		ValueArray* constants = &function->chunk.constants;
+		if (function->accessor != ACCESSOR_NONE &&
+			(function->accessorField >= constants->count || !IS_STRING(constants->values[function->accessorField])))
+			reader->failed = true;
+		else
+			freezeChunk(&function->chunk);
+	}
+}
+
+// The first pass makes each object with whatever it needs that's numbered before it, the second fills in the rest
+static void readObject(Reader* reader, uint32_t id)
+{
+	bool linking = reader->linking;
+	ObjType type = (ObjType)readU8(reader);
+	switch (type)
+	{
+	case OBJ_STRING:
+	{
+		bool interned = readU8(reader) != 0;
+		uint32_t length = readCount(reader, INT32_MAX, 1);
+		const char* chars = (const char*)readBytes(reader, length);
+		if (chars == NULL || linking)
+			break;
+
+		if (interned)
+		{
+			restored[id] = (Obj*)copyString(chars, (int)length);
+		}
+		else
+		{
+			ObjString* string = allocateString((int)length);
+			memcpy(string->chars, chars, length);
+			restored[id] = (Obj*)string;
+		}
+		break;
+	}
+	case OBJ_FUNCTION:
+		readFunction(reader, id);
+		break;
+	case OBJ_NATIVE:
+	{
+		NativeFn function = nativeAt((int)readU32(reader));
+		if (function == NULL)
+			reader->failed = true;
+		else if (!linking)
+			restored[id] = (Obj*)newNative(function);
+		break;
+	}
+	case OBJ_CLASS:
+	{
+		ObjString* name = (ObjString*)readReference(reader, OBJ_STRING, false);
+		if (!linking && !reader->failed)
+			restored[id] = (Obj*)newClass(name);
+		readTable(reader, &((ObjClass*)restored[id])->methods);
+		break;
+	}
+	case OBJ_UPVALUE:
+	{
+		Value closed = readValue(reader);
+		if (!linking && !reader->failed)
+		{
+			ObjUpvalue* upvalue = newUpvalue(NULL);
+			upvalue->location = &upvalue->closed; // Always closed
+			restored[id] = (Obj*)upvalue;
+		}
+		else if (linking)
+		{
+			((ObjUpvalue*)restored[id])->closed = closed;
+		}
+		break;
+	}
+	case OBJ_CLOSURE:
+	{
+		ObjFunction* function = (ObjFunction*)readReference(reader, OBJ_FUNCTION, false);
+		uint32_t upvalueCount = readU32(reader);
+		if (reader->failed || upvalueCount != (uint32_t)function->upvalueCount)
+		{
+			reader->failed = true;
+			break;
+		}
+
+		ObjClosure* closure = linking ? NULL : newClosure(function);
+		if (closure != NULL)
+			restored[id] = (Obj*)closure;
+		for (uint32_t i = 0; i < upvalueCount; i++)
+		{
+			ObjUpvalue* upvalue = (ObjUpvalue*)readReference(reader, OBJ_UPVALUE, false);
+			if (closure != NULL && upvalue != NULL)
+				closure->upvalues[i] = TO_REF(upvalue);
+		}
+		break;
+	}
+	case OBJ_INSTANCE:
+	{
+		ObjClass* klass = (ObjClass*)readReference(reader, OBJ_CLASS, false);
+		if (!linking && !reader->failed)
+			restored[id] = (Obj*)newInstance(klass);
+		readTable(reader, &((ObjInstance*)restored[id])->fields);
+		break;
+	}
+	case OBJ_BOUND_METHOD:
+	{
+		Value receiver = readValue(reader);
+		ObjClosure* method = (ObjClosure*)readReference(reader, OBJ_CLOSURE, false);
+		if (reader->failed)
+			break;
+		if (!linking)
+			restored[id] = (Obj*)newBoundMethod(NIL_VAL, method);
+		else
+			((ObjBoundMethod*)restored[id])->receiver = receiver;
+		break;
+	}
+	default:
+		reader->failed = true;
+		break;
+	}
+
+	if (!linking && restored[id] == NULL)
+		reader->failed = true;
+}
+
+static uint8_t* readSnapshotFile(const char* path, size_t* size)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+
+	fseek(file, 0L, SEEK_END);
+	long fileSize = ftell(file);
+	rewind(file);
+
+	uint8_t* bytes = fileSize > 0 ? (uint8_t*)malloc(fileSize) : NULL;
+	if (bytes != NULL && fread(bytes, 1, fileSize, file) < (size_t)fileSize)
+	{
+		free(bytes);
+		bytes = NULL;
+	}
+
+	fclose(file);
+	*size = (size_t)fileSize;
+	return bytes;
+}
+
+bool restoreSnapshot(const char* path)
+{
+	size_t size;
+	uint8_t* bytes = readSnapshotFile(path, &size);
+	if (bytes == NULL)
+		return false;
+
+	Reader reader = { bytes, bytes + size, false, false };
+	const uint8_t* magic = readBytes(&reader, 4);
+	bool valid = magic != NULL && memcmp(magic, SNAPSHOT_MAGIC, 4) == 0 &&
+		readU32(&reader) == SNAPSHOT_VERSION &&
+		readU32(&reader) == OP_WIDE + 1;
+	uint32_t objectCount = readCount(&reader, INT32_MAX, 1);
+	uint32_t globalCount = readU32(&reader);
+	uint64_t payloadLength = readU64(&reader);
+	uint64_t payloadHash = readU64(&reader);
+	valid = valid && !reader.failed && payloadLength == (uint64_t)(reader.end - reader.current) &&
+		payloadHash == hashBytes(reader.current, (size_t)payloadLength);
+
+	if (valid)
+	{
+		restored = ALLOCATE(Obj*, objectCount);
+		for (uint32_t i = 0; i < objectCount; i++)
+			restored[i] = NULL;
+		restoredCount = objectCount;
+
+		const uint8_t* objects = reader.current;
+		for (int pass = 0; pass < 2 && !reader.failed; pass++)
+		{
+			reader.current = objects;
+			reader.linking = pass == 1;
+			for (uint32_t i = 0; i < objectCount && !reader.failed; i++)
+				readObject(&reader, i);
+		}
+
+		// Checked all the way through before any of it goes in, so a bad file leaves the globals alone
+		const uint8_t* globals = reader.current;
+		for (int pass = 0; pass < 2 && !reader.failed; pass++)
+		{
+			reader.current = globals;
+			for (uint32_t i = 0; i < globalCount && !reader.failed; i++)
+			{
+				ObjString* name = readKey(&reader);
+				Value value = readValue(&reader);
+				if (pass == 1)
+					tableSet(&vm.globals, name, value);
+			}
+		}
+		valid = !reader.failed && reader.current == reader.end;
+
+		FREE_ARRAY(Obj*, restored, objectCount);
+		restored = NULL;
+		restoredCount = 0;
+	}
+
+	free(bytes);
+	return valid;
+}
+
+void markSnapshotRoots()
+{
+	for (uint32_t i = 0; i < restoredCount; i++)
+		markObject(restored[i]);
+}
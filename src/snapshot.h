@@ -0,0 +1,13 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "common.h"
+
+// Everything reachable from the globals, saved once a script has finished setting them up (-s), and put back before the next one runs (-r)
+// Only taken between scripts, so there are no frames, nothing on the stack and no open upvalues to save
+bool saveSnapshot(const char* path);
+// False if the file is missing, damaged or from a different build. The VM is left as it was then
+bool restoreSnapshot(const char* path);
+void markSnapshotRoots();
+
+#endif
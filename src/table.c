@@ -24,12 +24,13 @@ void freeTable(Table* table)
 static Entry* findEntry(Entry* entries, int	capacity, ObjString* key)
 {
 	uint32_t index = key->hash & (capacity - 1); // Capacity is always a power of 2
+	REF(ObjString) keyRef = TO_REF(key);
 	Entry* tombstone = NULL;
 
 	for (;;)
 	{
 		Entry* entry = &entries[index];
-		if (entry->key == NULL)
+		if (entry->key == NULL_REF)
 		{
 			if (IS_NIL(entry->value))
 			{
@@ -42,7 +43,7 @@ static Entry* findEntry(Entry* entries, int	capacity, ObjString* key)
 					tombstone = entry;
 			}
 		}
-		else if (entry->key == key)
+		else if (entry->key == keyRef)
 		{
 			return entry;
 		}
@@ -56,7 +57,7 @@ static void	adjustCapacity(Table* table, int capacity)
 	Entry* entries = ALLOCATE(Entry, capacity);
 	for (int i = 0; i < capacity; i++)
 	{
-		entries[i].key = NULL;
+		entries[i].key = NULL_REF;
 		entries[i].value = NIL_VAL;
 	}
 
@@ -66,10 +67,10 @@ static void	adjustCapacity(Table* table, int capacity)
 	for (int i = 0; i < table->capacity; i++)
 	{
 		Entry* entry = &table->entries[i]; // Address to the entry
-		if (entry->key == NULL)
+		if (entry->key == NULL_REF)
 			continue;
 
-		Entry* dest = findEntry(entries, capacity, entry->key);
+		Entry* dest = findEntry(entries, capacity, FROM_REF(ObjString, entry->key));
 		dest->key = entry->key;
 		dest->value = entry->value;
 		table->count++;
@@ -88,7 +89,7 @@ bool tableGet(Table* table, ObjString* key, Value* value)
 		return false;
 
 	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL)
+	if (entry->key == NULL_REF)
 		return false;
 
 	*value = entry->value; // Set memory at address
@@ -105,11 +106,11 @@ bool tableSet(Table* table, ObjString* key, Value value)
 
 	Entry* entry = findEntry(table->entries, table->capacity, key);
 
-	bool isNewKey = entry->key == NULL;
+	bool isNewKey = entry->key == NULL_REF;
 	if (isNewKey && IS_NIL(entry->value)) // Don't increment when filling a tombstone
 		table->count++;
 
-	entry->key = key;
+	entry->key = TO_REF(key);
 	entry->value = value;
 
 	return isNewKey;
@@ -121,11 +122,11 @@ bool tableDelete(Table* table, ObjString* key)
 		return false;
 
 	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL)
+	if (entry->key == NULL_REF)
 		return false;
 
 	// Place tombstone
-	entry->key == NULL;
+	entry->key = NULL_REF;
 	entry->value = BOOL_VAL(true);
 
 	return true;
@@ -136,9 +137,9 @@ void tableAddAll(Table* from, Table* to)
 	for (int i = 0; i < from->capacity; i++)
 	{
 		Entry* entry = &from->entries[i];
-		if (entry->key != NULL)
+		if (entry->key != NULL_REF)
 		{
-			tableSet(to, entry->key, entry->value);
+			tableSet(to, FROM_REF(ObjString, entry->key), entry->value);
 		}
 	}
 }
@@ -152,16 +153,17 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
 	for (;;)
 	{
 		Entry* entry = &table->entries[index];
-		if (entry->key == NULL)
+		if (entry->key == NULL_REF)
 		{
 			// Stop if we find an empty, non-tombstone entry
 			if (IS_NIL(entry->value))
 				return NULL;
 		}
-		else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0)
+		else
 		{
-			// Found it
-			return entry->key;
+			ObjString* key = FROM_REF(ObjString, entry->key);
+			if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0)
+				return key; // Found it
 		}
 
 		index = (index + 1) & (table->capacity - 1);
@@ -174,9 +176,10 @@ void tableRemoveWhite(Table* table)
 	for (int i = 0; i < table->capacity; i++)
 	{
 		Entry* entry = &table->entries[i];
-		if (entry->key != NULL && !entry->key->obj.isMarked)
+		ObjString* key = FROM_REF(ObjString, entry->key);
+		if (key != NULL && !IS_MARKED(&key->obj))
 		{
-			tableDelete(table, entry->key);
+			tableDelete(table, key);
 		}
 	}
 }
@@ -186,7 +189,7 @@ void markTable(Table* table)
 	for (int i = 0; i < table->capacity; i++)
 	{
 		Entry* entry = &table->entries[i];
-		markObject((Obj*)entry->key);
+		markObject((Obj*)FROM_REF(ObjString, entry->key));
 		markValue(entry->value);
 	}
 }
\ No newline at end of file
@@ -3,12 +3,20 @@
 
 #include "common.h"
 #include "value.h"
+#include "heap.h"
 
+// With compressed refs, packing drops the padding after the 4-byte key so an entry is 12 bytes instead of 16
+#ifdef COMPRESSED_POINTERS
+#pragma pack(push, 4)
+#endif
 typedef struct
 {
-	ObjString* key;
+	REF(ObjString) key;
 	Value value;
 } Entry;
+#ifdef COMPRESSED_POINTERS
+#pragma pack(pop)
+#endif
 
 typedef struct
 {
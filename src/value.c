@@ -50,6 +50,11 @@ void printValue(Value value)
 	{
 		printObject(value);
 	}
+	else if (IS_SHORT_STRING(value))
+	{
+		char chars[SHORT_STRING_MAX];
+		printf("%.*s", shortStringChars(value, chars), chars);
+	}
 #else
 	switch (value.type)
 	{
@@ -64,6 +69,12 @@ void printValue(Value value)
 		break;
 	case VAL_OBJ:
 		printObject(value); break;
+	case VAL_SHORT_STRING:
+	{
+		char chars[SHORT_STRING_MAX];
+		printf("%.*s", shortStringChars(value, chars), chars);
+		break;
+	}
 	}
 #endif
 }
@@ -76,17 +87,32 @@ bool valuesEqual(Value a, Value b)
 		// Special case to handle that NaN == NaN should be false
 		return AS_NUMBER(a) == AS_NUMBER(b);
 	}
-	return a == b;
+	if (a == b)
+		return true;
+	if (IS_STRING_LIKE(a) && IS_STRING_LIKE(b))
+		return stringsEqual(a, b);
+	return false;
 #else 
 	if (a.type != b.type)
+	{
+		// A short string can't equal a heap string, but let stringsEqual() decide rather than rely on that
+		if (IS_STRING_LIKE(a) && IS_STRING_LIKE(b))
+			return stringsEqual(a, b);
 		return false;
+	}
 
 	switch (a.type)
 	{
 	case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
 	case VAL_NIL: return true;
 	case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-	case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+	case VAL_OBJ:
+		if (AS_OBJ(a) == AS_OBJ(b))
+			return true;
+		if (IS_STRING_LIKE(a) && IS_STRING_LIKE(b))
+			return stringsEqual(a, b);
+		return false;
+	case VAL_SHORT_STRING: return SHORT_STRING_PAYLOAD(a) == SHORT_STRING_PAYLOAD(b);
 	default: return false; // Unreachable
 	}
 #endif
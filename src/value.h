@@ -16,6 +16,7 @@ typedef struct ObjString ObjString;
 #define TAG_NIL 1 // 01
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE 3 // 11
+#define SHORT_STRING_TAG ((uint64_t)0x0002000000000000) // Bit 49 - unused by nil, bools and canonical NaNs
 
 typedef	uint64_t Value;
 
@@ -24,6 +25,8 @@ typedef	uint64_t Value;
 #define IS_NUMBER(value) (((value) & QNAN) != QNAN)
 #define IS_OBJ(value) \
  (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_SHORT_STRING(value) \
+ (((value) & (SIGN_BIT | QNAN | SHORT_STRING_TAG)) == (QNAN | SHORT_STRING_TAG))
 
 #define AS_BOOL(value) ((value) == TRUE_VAL)
 #define AS_NUMBER(value) valueToNum(value)
@@ -38,6 +41,9 @@ typedef	uint64_t Value;
 #define OBJ_VAL(obj) \
 	(Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
+#define SHORT_STRING_PAYLOAD(value) ((value) & ~(QNAN | SHORT_STRING_TAG))
+#define SHORT_STRING_PAYLOAD_VAL(payload) ((Value)(QNAN | SHORT_STRING_TAG | (payload)))
+
 static inline double valueToNum(Value value)
 {
 	double num;
@@ -59,7 +65,8 @@ typedef enum
 	VAL_BOOL,
 	VAL_NIL,
 	VAL_NUMBER,
-	VAL_OBJ
+	VAL_OBJ,
+	VAL_SHORT_STRING
 } ValueType;
 
 typedef struct
@@ -70,6 +77,7 @@ typedef struct
 		bool boolean;
 		double number;
 		Obj* obj;
+		uint64_t shortString;
 	} as;
 } Value;
 
@@ -78,6 +86,7 @@ typedef struct
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_SHORT_STRING(value) ((value).type == VAL_SHORT_STRING)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -88,8 +97,37 @@ typedef struct
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+#define SHORT_STRING_PAYLOAD(value) ((value).as.shortString)
+#define SHORT_STRING_PAYLOAD_VAL(payload) ((Value){VAL_SHORT_STRING, {.shortString = payload}})
+
 #endif
 
+// Strings this short live in the Value itself - no allocation, no interning and nothing for the GC to trace
+// Payload: length in bits 40-42, chars in bits 0-39 (first char lowest). Unused chars are zero, so equal strings have equal bits
+#define SHORT_STRING_MAX 5
+
+static inline Value makeShortString(const char* chars, int length)
+{
+	uint64_t payload = (uint64_t)length << 40;
+	for (int i = 0; i < length; i++)
+	{
+		payload |= (uint64_t)(uint8_t)chars[i] << (8 * i);
+	}
+	return SHORT_STRING_PAYLOAD_VAL(payload);
+}
+
+// Unpacks into buffer, which needs room for SHORT_STRING_MAX chars. Returns the length
+static inline int shortStringChars(Value value, char* buffer)
+{
+	uint64_t payload = SHORT_STRING_PAYLOAD(value);
+	int length = (int)((payload >> 40) & 0x7);
+	for (int i = 0; i < length; i++)
+	{
+		buffer[i] = (char)(payload >> (8 * i));
+	}
+	return length;
+}
+
 typedef	struct
 {
 	int capacity;
@@ -5,6 +5,7 @@
 
 #include "common.h"
 #include "vm.h"
+#include "cache.h"
 #include "compiler.h"
 #include "debug.h"
 #include "object.h"
@@ -18,6 +19,77 @@ static Value clockNative(int argCount, Value* args)
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// Lox numbers are doubles. Clamp before converting so NaN and huge values can't overflow the int
+static int clampIndex(double index, int length)
+{
+	if (!(index > 0))
+		return 0;
+	if (index > length)
+		return length;
+	return (int)index;
+}
+
+// Short pieces are cheaper to pack into a value than to point at
+static Value slice(Value string, const char* chars, int start, int length)
+{
+	if (length <= SHORT_STRING_MAX)
+		return makeShortString(chars + start, length);
+	return OBJ_VAL(newView(string, start, length));
+}
+
+// substring(string, start, end) - a view of chars [start, end). Indices are clamped to the string
+static Value substringNative(int argCount, Value* args)
+{
+	if (argCount != 3 || !IS_STRING_LIKE(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2]))
+		return NIL_VAL;
+
+	char buffer[SHORT_STRING_MAX];
+	int length;
+	const char* chars = stringChars(args[0], buffer, &length);
+
+	int start = clampIndex(AS_NUMBER(args[1]), length);
+	int end = clampIndex(AS_NUMBER(args[2]), length);
+	if (end < start)
+		end = start;
+
+	return slice(args[0], chars, start, end - start);
+}
+
+// split(string, separator, index) - a view of the index-th field between separators, or nil past the last field
+// Lox has no lists, so fields are fetched one at a time
+static Value splitNative(int argCount, Value* args)
+{
+	if (argCount != 3 || !IS_STRING_LIKE(args[0]) || !IS_STRING_LIKE(args[1]) || !IS_NUMBER(args[2]))
+		return NIL_VAL;
+
+	char buffer[SHORT_STRING_MAX], separatorBuffer[SHORT_STRING_MAX];
+	int length, separatorLength;
+	const char* chars = stringChars(args[0], buffer, &length);
+	const char* separator = stringChars(args[1], separatorBuffer, &separatorLength);
+	double index = AS_NUMBER(args[2]);
+
+	if (separatorLength == 0 || !(index >= 0))
+		return NIL_VAL;
+
+	int fieldStart = 0;
+	for (int i = 0; i <= length - separatorLength; i++)
+	{
+		if (memcmp(chars + i, separator, separatorLength) != 0)
+			continue;
+
+		if (index < 1)
+			return slice(args[0], chars, fieldStart, i - fieldStart);
+
+		index--;
+		i += separatorLength - 1;
+		fieldStart = i + 1;
+	}
+
+	if (index < 1)
+		return slice(args[0], chars, fieldStart, length - fieldStart);
+	return NIL_VAL;
+}
+
 void resetStack()
 {
 	vm.stackTop = vm.stack;
@@ -39,7 +111,10 @@ static void runtimeError(const char* format, ...)
 		ObjFunction* function = frame->closure->function;
 		size_t instruction = frame->ip - function->chunk.code - 1; // -1 since ip is sitting on the next instruction
 
-		fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+		int line = getLine(&function->chunk.lines, (int)instruction);
+		if (line != 0)
+			fprintf(stderr, "[line %d] ", line); // Nothing to say with STRIP_LINES
+		fprintf(stderr, "in ");
 		if (function->name == NULL)
 		{
 			fprintf(stderr, "script\n");
@@ -53,6 +128,35 @@ static void runtimeError(const char* format, ...)
 	resetStack();
 }
 
+// In the order they're defined. Snapshots refer to natives by their index in here
+static const struct
+{
+	const char* name;
+	NativeFn function;
+} natives[] =
+{
+	{ "clock", clockNative },
+	{ "substring", substringNative },
+	{ "split", splitNative }
+};
+
+#define NATIVE_COUNT ((int)(sizeof(natives) / sizeof(natives[0])))
+
+int nativeIndex(NativeFn function)
+{
+	for (int i = 0; i < NATIVE_COUNT; i++)
+	{
+		if (natives[i].function == function)
+			return i;
+	}
+	return -1;
+}
+
+NativeFn nativeAt(int index)
+{
+	return index >= 0 && index < NATIVE_COUNT ? natives[index].function : NULL;
+}
+
 static void	defineNative(const char* name, NativeFn function)
 {
 	push(OBJ_VAL(copyString(name, (int)strlen(name))));
@@ -66,8 +170,8 @@ static void	defineNative(const char* name, NativeFn function)
 
 void initVM()
 {
+	initHeap();
 	resetStack();
-	vm.objects = NULL;
 
 	vm.grayCount = 0;
 	vm.grayCapacity = 0;
@@ -82,7 +186,10 @@ void initVM()
 	vm.initString = NULL;
 	vm.initString = copyString("init", 4);
 
-	defineNative("clock", clockNative);
+	for (int i = 0; i < NATIVE_COUNT; i++)
+	{
+		defineNative(natives[i].name, natives[i].function);
+	}
 }
 
 void freeVM()
@@ -92,6 +199,8 @@ void freeVM()
 	freeTable(&vm.strings);
 	vm.initString = NULL;
 	freeObjects();
+	freeCachedImages(); // After the functions that run from them
+	freeHeap();
 }
 
 void push(Value value)
@@ -112,6 +221,13 @@ static Value peek(int distance)
 	return vm.stackTop[-1 - distance];
 }
 
+// Frames of up to UINT8_COUNT slots always fit. A function with more locals than that uses the stack's extra room,
+// and has to leave enough of it for every frame that could still come after it
+static bool hasStackRoom(ObjFunction* function, Value* slots, int frameCount)
+{
+	return function->localCount <= UINT8_MAX || slots + function->localCount + (FRAMES_MAX - frameCount) * UINT8_COUNT <= vm.stack + STACK_MAX;
+}
+
 static bool call(ObjClosure* closure, int argCount)
 {
 	if (argCount != closure->function->arity)
@@ -126,6 +242,12 @@ static bool call(ObjClosure* closure, int argCount)
 		return false;
 	}
 
+	if (!hasStackRoom(closure->function, vm.stackTop - argCount - 1, vm.frameCount))
+	{
+		runtimeError("Stack overflow.");
+		return false;
+	}
+
 	CallFrame* frame = &vm.frames[vm.frameCount++];
 
 	frame->closure = closure;
@@ -135,6 +257,34 @@ static bool call(ObjClosure* closure, int argCount)
 	return true;
 }
 
+// Getters and setters don't need a frame. Anything unusual goes through a real call, so errors come out the same
+static bool callMethod(ObjClosure* method, int argCount)
+{
+	ObjFunction* function = method->function;
+	if (function->accessor != ACCESSOR_NONE && argCount == function->arity)
+	{
+		ObjInstance* instance = AS_INSTANCE(vm.stackTop[-argCount - 1]);
+		ObjString* field = AS_STRING(function->chunk.constants.values[function->accessorField]);
+
+		if (function->accessor == ACCESSOR_SETTER)
+		{
+			tableSet(&instance->fields, field, peek(0));
+			vm.stackTop -= 2;
+			push(NIL_VAL);
+			return true;
+		}
+
+		Value value;
+		if (tableGet(&instance->fields, field, &value))
+		{
+			vm.stackTop[-1] = value;
+			return true;
+		}
+	}
+
+	return call(method, argCount);
+}
+
 static bool	callValue(Value callee, int argCount)
 {
 	if (IS_OBJ(callee))
@@ -145,7 +295,7 @@ static bool	callValue(Value callee, int argCount)
 		{
 			ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
 			vm.stackTop[-argCount - 1] = bound->receiver; // Put this in stack slot 0
-			return call(bound->method, argCount);
+			return callMethod(bound->method, argCount);
 		}
 		case OBJ_CLASS:
 		{
@@ -193,7 +343,7 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount)
 		runtimeError("Undefined property '%s'.", name->chars);
 		return false;
 	}
-	return call(AS_CLOSURE(method), argCount);
+	return callMethod(AS_CLOSURE(method), argCount);
 }
 
 static bool invoke(ObjString* name, int argCount)
@@ -242,7 +392,7 @@ static ObjUpvalue* captureUpvalue(Value* local)
 	while (upvalue != NULL && upvalue->location > local)
 	{
 		prevUpvalue = upvalue;
-		upvalue = upvalue->next;
+		upvalue = FROM_REF(ObjUpvalue, upvalue->next);
 	}
 
 	if (upvalue != NULL && upvalue->location == local)
@@ -251,7 +401,7 @@ static ObjUpvalue* captureUpvalue(Value* local)
 	}
 
 	ObjUpvalue* createdUpvalue = newUpvalue(local);
-	createdUpvalue->next = upvalue;
+	createdUpvalue->next = TO_REF(upvalue);
 
 	if (prevUpvalue == NULL)
 	{
@@ -259,7 +409,7 @@ static ObjUpvalue* captureUpvalue(Value* local)
 	}
 	else
 	{
-		prevUpvalue->next = createdUpvalue;
+		prevUpvalue->next = TO_REF(createdUpvalue);
 	}
 
 	return createdUpvalue;
@@ -272,7 +422,7 @@ static void closeUpvalues(Value* last)
 		ObjUpvalue* upvalue = vm.openUpvalues;
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
-		vm.openUpvalues = upvalue->next;
+		vm.openUpvalues = FROM_REF(ObjUpvalue, upvalue->next);
 	}
 }
 
@@ -289,26 +439,123 @@ static bool isFalsey(Value value)
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+// Results at least this long become ropes, so building a long string in a loop doesn't copy and hash every step
+#define ROPE_MIN_LENGTH 64
+
+// a and b must be on the stack so the GC can see them
+static Value concatenate(Value a, Value b)
 {
-	ObjString* b = AS_STRING(peek(0));
-	ObjString* a = AS_STRING(peek(1));
+	char aBuffer[SHORT_STRING_MAX], bBuffer[SHORT_STRING_MAX];
+	int aLength, bLength;
+	const char* bChars = stringChars(b, bBuffer, &bLength);
+	const char* aChars = stringChars(a, aBuffer, &aLength);
 
-	int length = a->length + b->length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
+	Value result;
+	if (aLength + bLength <= SHORT_STRING_MAX)
+	{
+		char chars[SHORT_STRING_MAX];
+		memcpy(chars, aChars, aLength);
+		memcpy(chars + aLength, bChars, bLength);
+		result = makeShortString(chars, aLength + bLength);
+	}
+	else if (IS_ROPE(a))
+	{
+		result = OBJ_VAL(appendRope(AS_ROPE(a), bChars, bLength));
+	}
+	else if (aLength + bLength >= ROPE_MIN_LENGTH)
+	{
+		result = OBJ_VAL(newRope(aChars, aLength, bChars, bLength));
+	}
+	else
+	{
+		// Build the result in place - no separate char buffer to allocate and free
+		ObjString* string = allocateString(aLength + bLength);
+		memcpy(string->chars, aChars, aLength);
+		memcpy(string->chars + aLength, bChars, bLength);
+		result = OBJ_VAL(string);
+	}
 
-	ObjString* result = takeString(chars, length);
-	pop(); // Pop component strings
-	pop();
-	push(OBJ_VAL(result));
+	return result;
+}
+
+// OP_CONCAT_N: the top count values are the operands of a + chain, added left to right
+static bool addMany(int count)
+{
+	Value* operands = vm.stackTop - count;
+
+	if (IS_NUMBER(operands[0]))
+	{
+		double sum = AS_NUMBER(operands[0]);
+		for (int i = 1; i < count; i++)
+		{
+			if (!IS_NUMBER(operands[i]))
+			{
+				runtimeError("Operands must be two strings or two numbers.");
+				return false;
+			}
+			sum += AS_NUMBER(operands[i]);
+		}
+
+		vm.stackTop -= count;
+		push(NUMBER_VAL(sum));
+		return true;
+	}
+
+	int length = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (!IS_STRING_LIKE(operands[i]))
+		{
+			runtimeError("Operands must be two strings or two numbers.");
+			return false;
+		}
+
+		length += stringLength(operands[i]);
+	}
+
+	if (length < ROPE_MIN_LENGTH)
+	{
+		// One allocation and one copy per operand, instead of an intermediate string per +
+		char shortChars[SHORT_STRING_MAX];
+		ObjString* string = NULL;
+		char* dest = shortChars;
+		if (length > SHORT_STRING_MAX)
+		{
+			string = allocateString(length);
+			dest = string->chars;
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			char buffer[SHORT_STRING_MAX];
+			int operandLength;
+			const char* chars = stringChars(operands[i], buffer, &operandLength);
+			memcpy(dest, chars, operandLength);
+			dest += operandLength;
+		}
+
+		vm.stackTop -= count;
+		push(string != NULL ? OBJ_VAL(string) : makeShortString(shortChars, length));
+		return true;
+	}
+
+	// Long results go through ropes, so a rope on the left keeps appending in place
+	// Each partial result goes back in operands[0] so the GC can see it
+	for (int i = 1; i < count; i++)
+	{
+		operands[0] = concatenate(operands[0], operands[i]);
+	}
+
+	vm.stackTop -= count - 1;
+	return true;
 }
 
-InterpretResult	interpret(const char* source)
+InterpretResult	interpret(const char* source, size_t length)
 {
-	ObjFunction* function = compile(source);
+	ObjFunction* function = loadCachedScript(source, length);
+	bool cached = function != NULL;
+	if (!cached)
+		function = compile(source, length);
 
 	if (function == NULL)
 	{
@@ -316,6 +563,8 @@ InterpretResult	interpret(const char* source)
 	}
 
 	push(OBJ_VAL(function));
+	if (!cached)
+		saveCachedScript(source, length, function);
 	ObjClosure* closure = newClosure(function);
 	pop(); // Pop the function
 	push(OBJ_VAL(closure));
@@ -334,7 +583,10 @@ static InterpretResult run()
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_SHORT() \
 	(frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1])) // Shift the first one over a byte, then add the second one
+#define READ_LONG() \
+	(frame->ip += 3, (uint32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define STRING_AT(index) AS_STRING(frame->closure->function->chunk.constants.values[index])
 
 	// Use do/while to keep everything in one scope
 	// Pop b then a, so it's left-to-right
@@ -349,6 +601,31 @@ static InterpretResult run()
 		push(valueType(a op b)); \
 	} while (false)
 
+	// Same thing without the checks
+#define NUMBER_OP(valueType, op) \
+	do { \
+		double b = AS_NUMBER(pop()); \
+		double a = AS_NUMBER(pop()); \
+		push(valueType(a op b)); \
+	} while (false)
+
+	// A local compared with another operand, then OP_JUMP_IF_FALSE without anything left on the stack
+#define COMPARE_JUMP(op, right) \
+	do { \
+		Value a = frame->slots[READ_BYTE()]; \
+		Value b = right; \
+		uint16_t offset = READ_SHORT(); \
+		if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+			runtimeError("Operands must be numbers."); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		if (!(AS_NUMBER(a) op AS_NUMBER(b))) \
+			frame->ip += offset; \
+	} while (false)
+
+	uint32_t operand; // Index or jump offset, for the instructions OP_WIDE can widen
+	bool wide; // Whether OP_CLOSURE's upvalue indexes are wide too
+
 	for (;;)
 	{
 #ifdef  DEBUG_TRACE_EXECUTION
@@ -371,25 +648,28 @@ static InterpretResult run()
 			push(constant);
 			break;
 		}
+		case OP_CONSTANT_LONG:
+			push(frame->closure->function->chunk.constants.values[READ_LONG()]);
+			break;
 		case OP_NIL: push(NIL_VAL); break;
 		case OP_TRUE: push(BOOL_VAL(true)); break;
 		case OP_FALSE: push(BOOL_VAL(false)); break;
 		case OP_POP: pop(); break;
 		case OP_GET_LOCAL:
-		{
-			uint8_t slot = READ_BYTE();
-			push(frame->slots[slot]); // Must be at the top of the stack for other instructions
+			operand = READ_BYTE();
+		getLocal:
+			push(frame->slots[operand]); // Must be at the top of the stack for other instructions
 			break;
-		}
 		case OP_SET_LOCAL:
-		{
-			uint8_t slot = READ_BYTE();
-			frame->slots[slot] = peek(0); // Don't pop
+			operand = READ_BYTE();
+		setLocal:
+			frame->slots[operand] = peek(0); // Don't pop
 			break;
-		}
 		case OP_GET_GLOBAL:
+			operand = READ_BYTE();
+		getGlobal:
 		{
-			ObjString* name = READ_STRING();
+			ObjString* name = STRING_AT(operand);
 			Value value;
 
 			if (!tableGet(&vm.globals, name, &value))
@@ -402,15 +682,19 @@ static InterpretResult run()
 			break;
 		}
 		case OP_DEFINE_GLOBAL:
+			operand = READ_BYTE();
+		defineGlobal:
 		{
-			ObjString* name = READ_STRING();
+			ObjString* name = STRING_AT(operand);
 			tableSet(&vm.globals, name, peek(0));
 			pop(); // Wait to pop in case of garbage collection
 			break;
 		}
 		case OP_SET_GLOBAL:
+			operand = READ_BYTE();
+		setGlobal:
 		{
-			ObjString* name = READ_STRING();
+			ObjString* name = STRING_AT(operand);
 			if (tableSet(&vm.globals, name, peek(0)))
 			{
 				// Variable was not previously defined
@@ -422,18 +706,18 @@ static InterpretResult run()
 			break;
 		}
 		case OP_GET_UPVALUE:
-		{
-			uint8_t slot = READ_BYTE();
-			push(*frame->closure->upvalues[slot]->location);
+			operand = READ_BYTE();
+		getUpvalue:
+			push(*FROM_REF(ObjUpvalue, frame->closure->upvalues[operand])->location);
 			break;
-		}
 		case OP_SET_UPVALUE:
-		{
-			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(0); // Peek instead of pop since assignment is an expression
+			operand = READ_BYTE();
+		setUpvalue:
+			*FROM_REF(ObjUpvalue, frame->closure->upvalues[operand])->location = peek(0); // Peek instead of pop since assignment is an expression
 			break;
-		}
 		case OP_GET_PROPERTY:
+			operand = READ_BYTE();
+		getProperty:
 		{
 			if (!IS_INSTANCE(peek(0)))
 			{
@@ -442,7 +726,7 @@ static InterpretResult run()
 			}
 
 			ObjInstance* instance = AS_INSTANCE(peek(0));
-			ObjString* name = READ_STRING();
+			ObjString* name = STRING_AT(operand);
 
 			Value value;
 			if (tableGet(&instance->fields, name, &value))
@@ -459,6 +743,8 @@ static InterpretResult run()
 			break;
 		}
 		case OP_SET_PROPERTY:
+			operand = READ_BYTE();
+		setProperty:
 		{
 			if (!IS_INSTANCE(peek(1)))
 			{
@@ -467,7 +753,7 @@ static InterpretResult run()
 			}
 
 			ObjInstance* instance = AS_INSTANCE(peek(1));
-			tableSet(&instance->fields, READ_STRING(), peek(0));
+			tableSet(&instance->fields, STRING_AT(operand), peek(0));
 
 			Value value = pop();
 			pop();
@@ -475,8 +761,10 @@ static InterpretResult run()
 			break;
 		}
 		case OP_GET_SUPER:
+			operand = READ_BYTE();
+		getSuper:
 		{
-			ObjString* name = READ_STRING();
+			ObjString* name = STRING_AT(operand);
 			ObjClass* superClass = AS_CLASS(pop());
 
 			if (!bindMethod(superClass, name))
@@ -497,9 +785,12 @@ static InterpretResult run()
 		case OP_LESS: BINARY_OP(BOOL_VAL, < ); break;
 		case OP_ADD:
 		{
-			if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+			if (IS_STRING_LIKE(peek(0)) && IS_STRING_LIKE(peek(1)))
 			{
-				concatenate();
+				Value result = concatenate(peek(1), peek(0));
+				pop(); // Pop component strings
+				pop();
+				push(result);
 			}
 			else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
 			{
@@ -514,6 +805,15 @@ static InterpretResult run()
 			}
 			break;
 		}
+		case OP_CONCAT_N:
+		{
+			int count = READ_BYTE();
+			if (!addMany(count))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			break;
+		}
 		case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
 		case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
 		case OP_DIVIDE: BINARY_OP(NUMBER_VAL, / ); break;
@@ -528,29 +828,62 @@ static InterpretResult run()
 			}
 			push(NUMBER_VAL(-AS_NUMBER(pop())));
 			break;
+		// The compiler proved both operands are numbers
+		case OP_GREATER_NN: NUMBER_OP(BOOL_VAL, > ); break;
+		case OP_LESS_NN: NUMBER_OP(BOOL_VAL, < ); break;
+		case OP_ADD_NN: NUMBER_OP(NUMBER_VAL, +); break;
+		case OP_SUBTRACT_NN: NUMBER_OP(NUMBER_VAL, -); break;
+		case OP_MULTIPLY_NN: NUMBER_OP(NUMBER_VAL, *); break;
+		case OP_DIVIDE_NN: NUMBER_OP(NUMBER_VAL, / ); break;
+		case OP_ADD_LOCAL:
+		{
+			uint8_t slot = READ_BYTE();
+			uint8_t amount = READ_BYTE();
+			if (!IS_NUMBER(frame->slots[slot]))
+			{
+				runtimeError("Operands must be two strings or two numbers."); // The amount is a number, so a string can't be added to it
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			frame->slots[slot] = NUMBER_VAL(AS_NUMBER(frame->slots[slot]) + amount);
+			break;
+		}
+		case OP_INC_LOCAL:
+		{
+			uint8_t slot = READ_BYTE();
+			uint8_t amount = READ_BYTE();
+			frame->slots[slot] = NUMBER_VAL(AS_NUMBER(frame->slots[slot]) + amount);
+			break;
+		}
 		case OP_PRINT:
 			printValue(pop());
 			printf("\n");
 			break;
 		case OP_JUMP:
-		{
-			uint16_t offset = READ_SHORT();
-			frame->ip += offset;
+			operand = READ_SHORT();
+		jump:
+			frame->ip += operand;
 			break;
-		}
 		case OP_JUMP_IF_FALSE:
-		{
-			uint16_t offset = READ_SHORT();
+			operand = READ_SHORT();
+		jumpIfFalse:
 			if (isFalsey(peek(0)))
-				frame->ip += offset;
+				frame->ip += operand;
+			break;
+		case OP_JUMP_IF_TRUE:
+			operand = READ_SHORT();
+		jumpIfTrue:
+			if (!isFalsey(peek(0)))
+				frame->ip += operand;
 			break;
-		}
 		case OP_LOOP:
-		{
-			uint16_t offset = READ_SHORT();
-			frame->ip -= offset;
+			operand = READ_SHORT();
+		loop:
+			frame->ip -= operand;
 			break;
-		}
+		case OP_JUMP_IF_NOT_LESS: COMPARE_JUMP(<, frame->slots[READ_BYTE()]); break;
+		case OP_JUMP_IF_NOT_GREATER: COMPARE_JUMP(>, frame->slots[READ_BYTE()]); break;
+		case OP_JUMP_IF_NOT_LESS_CONST: COMPARE_JUMP(<, READ_CONSTANT()); break;
+		case OP_JUMP_IF_NOT_GREATER_CONST: COMPARE_JUMP(>, READ_CONSTANT()); break;
 		case OP_CALL:
 		{
 			int argCount = READ_BYTE();
@@ -564,8 +897,10 @@ static InterpretResult run()
 			break;
 		}
 		case OP_INVOKE:
+			operand = READ_BYTE();
+		invokeMethod:
 		{
-			ObjString* method = READ_STRING();
+			ObjString* method = STRING_AT(operand);
 			int argCount = READ_BYTE();
 
 			if (!invoke(method, argCount))
@@ -577,8 +912,10 @@ static InterpretResult run()
 			break;
 		}
 		case OP_SUPER_INVOKE:
+			operand = READ_BYTE();
+		superInvoke:
 		{
-			ObjString* method = READ_STRING();
+			ObjString* method = STRING_AT(operand);
 			int argCount = READ_BYTE();
 			ObjClass* superclass = AS_CLASS(pop());
 
@@ -590,20 +927,50 @@ static InterpretResult run()
 			frame = &vm.frames[vm.frameCount - 1];
 			break;
 		}
-		case OP_CLOSURE:
+		case OP_INLINE_GUARD:
 		{
+			int argCount = READ_BYTE();
 			ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+			uint16_t offset = READ_SHORT();
+			Value callee = peek(argCount);
+			if (IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == function)
+				break; // Still the function that was inlined, so carry on into its body
+
+			// Something else has been bound to the name since. Skip the body and make a real call, which returns past it
+			frame->ip += offset;
+			if (!callValue(callee, argCount))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			frame = &vm.frames[vm.frameCount - 1];
+			break;
+		}
+		case OP_INLINE_RETURN:
+		{
+			// The inlined body's result replaces the callee and its arguments, like a return would
+			int argCount = READ_BYTE();
+			Value result = pop();
+			vm.stackTop -= argCount + 1;
+			push(result);
+			break;
+		}
+		case OP_CLOSURE:
+			operand = READ_BYTE();
+			wide = false;
+		makeClosure:
+		{
+			ObjFunction* function = AS_FUNCTION(frame->closure->function->chunk.constants.values[operand]);
 			ObjClosure* closure = newClosure(function);
 			push(OBJ_VAL(closure));
 
 			for (int i = 0; i < closure->upvalueCount; i++)
 			{
 				uint8_t isLocal = READ_BYTE();
-				uint8_t	index = READ_BYTE();
+				uint32_t index = wide ? READ_LONG() : READ_BYTE();
 
 				if (isLocal)
 				{
-					closure->upvalues[i] = captureUpvalue(frame->slots + index);
+					closure->upvalues[i] = TO_REF(captureUpvalue(frame->slots + index));
 				}
 				else
 				{
@@ -637,7 +1004,9 @@ static InterpretResult run()
 			break;
 		}
 		case OP_CLASS:
-			push(OBJ_VAL(newClass(READ_STRING())));
+			operand = READ_BYTE();
+		makeClass:
+			push(OBJ_VAL(newClass(STRING_AT(operand))));
 			break;
 		case OP_INHERIT:
 		{
@@ -654,14 +1023,74 @@ static InterpretResult run()
 			break;
 		}
 		case OP_METHOD:
-			defineMethod(READ_STRING());
+			operand = READ_BYTE();
+		addMethod:
+			defineMethod(STRING_AT(operand));
+			break;
+		case OP_LOAD_FUNCTION:
+		{
+			// First call of a function from an image, or of a lazy one. Start it over with its real code
+			ObjFunction* function = frame->closure->function;
+			if (function->image != NULL)
+			{
+				loadImageFunction(function);
+			}
+			else if (!compileLazyFunction(function))
+			{
+				runtimeError("Could not compile '%s'.", function->name->chars);
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			// call() could only guess at the locals of a lazy function
+			if (!hasStackRoom(function, frame->slots, vm.frameCount - 1))
+			{
+				runtimeError("Stack overflow.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			frame->ip = function->chunk.code;
 			break;
 		}
+		case OP_WIDE:
+		{
+			// Read the three-byte operand here, then carry on in the instruction's own case
+			uint8_t op = READ_BYTE();
+			operand = READ_LONG();
+			switch (op)
+			{
+			case OP_GET_LOCAL: goto getLocal;
+			case OP_SET_LOCAL: goto setLocal;
+			case OP_GET_GLOBAL: goto getGlobal;
+			case OP_DEFINE_GLOBAL: goto defineGlobal;
+			case OP_SET_GLOBAL: goto setGlobal;
+			case OP_GET_UPVALUE: goto getUpvalue;
+			case OP_SET_UPVALUE: goto setUpvalue;
+			case OP_GET_PROPERTY: goto getProperty;
+			case OP_SET_PROPERTY: goto setProperty;
+			case OP_GET_SUPER: goto getSuper;
+			case OP_JUMP: goto jump;
+			case OP_JUMP_IF_FALSE: goto jumpIfFalse;
+			case OP_JUMP_IF_TRUE: goto jumpIfTrue;
+			case OP_LOOP: goto loop;
+			case OP_INVOKE: goto invokeMethod;
+			case OP_SUPER_INVOKE: goto superInvoke;
+			case OP_CLOSURE: wide = true; goto makeClosure;
+			case OP_CLASS: goto makeClass;
+			case OP_METHOD: goto addMethod;
+			default: break; // The compiler never widens anything else
+			}
+			break;
+		}
+		}
 	}
 
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_STRING
+#undef STRING_AT
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef COMPARE_JUMP
 }
\ No newline at end of file
@@ -6,7 +6,7 @@
 #include "value.h"
 
 #define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT + UINT16_COUNT) // Room for one function with as many locals as the compiler allows
 
 typedef struct
 {
@@ -29,7 +29,6 @@ typedef	struct
 
 	size_t bytesAllocated;
 	size_t nextGC;
-	Obj* objects;
 
 	int grayCount;
 	int grayCapacity;
@@ -48,8 +47,11 @@ extern VM vm;
 
 void initVM();
 void freeVM();
-InterpretResult	interpret(const char* source);
+InterpretResult	interpret(const char* source, size_t length);
 void push(Value value);
 Value pop();
+// Natives by index, so they can be found again in another process. -1 or NULL if there's no such native
+int nativeIndex(NativeFn function);
+NativeFn nativeAt(int index);
 
 #endif
\ No newline at end of file